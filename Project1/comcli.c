@@ -6,83 +6,208 @@
 #include <sys/stat.h> 
 #include <string.h>
 #include <stdint.h>
-typedef enum {
-    CONREQUEST = 1,
-    CONREPLY,
-    COMLINE,
-    COMRESULT,
-    QUITREQ,
-    QUITREPLY,
-    QUITALL
-} MessageType;
-struct connection_request {
-    int client_id;
-    char cs_pipe_name[64];
-    char sc_pipe_name[64];
-    int wsize;
-};
-
-#define HEADER_SIZE 8 
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "comcodec.h"
+// with a socket the server connects to cs_pipe_name, and one
+// SOCK_SEQPACKET connection carries both directions
+int packet;
+
+#define DEFAULT_WSIZE 65536
+// largest COMRESULT frame the server may send, header included
+#define BATCH_DEPTH 16
+// commands a batch keeps in flight; their lines have to fit in the cs pipe
 
 void serialize_connection_request( struct connection_request *req, char *outStr) {
-    sprintf(outStr, "%d,%s,%s,%d", req->client_id, req->cs_pipe_name, req->sc_pipe_name, req->wsize);
-}
-void encode_message(uint8_t type, const void* data, size_t dataSize, uint8_t** encodedMessage, uint32_t* messageSize) {
-    *messageSize = HEADER_SIZE + dataSize; 
-    *encodedMessage = malloc(*messageSize);
-
-    (*encodedMessage)[0] = (uint8_t)(*messageSize & 0xFF);
-    (*encodedMessage)[1] = (uint8_t)((*messageSize >> 8) & 0xFF);
-    (*encodedMessage)[2] = (uint8_t)((*messageSize >> 16) & 0xFF);
-    (*encodedMessage)[3] = (uint8_t)((*messageSize >> 24) & 0xFF);
-
-    (*encodedMessage)[4] = type;
-
-    memcpy(*encodedMessage + HEADER_SIZE, data, dataSize);
+    sprintf(outStr, "%d,%s,%s,%d,%d", req->client_id, req->cs_pipe_name, req->sc_pipe_name, req->wsize, req->transport);
 }
 
-void decode_message(const uint8_t* encodedMessage, uint8_t* type, void* data, uint32_t* dataSize) {
-    if (encodedMessage == NULL || type == NULL || data == NULL || dataSize == NULL) {
-        fprintf(stderr, "Invalid argument to decode_message\n");
-        return;
-    }
-
-    *dataSize = (uint32_t)(encodedMessage[0]) |
-                ((uint32_t)(encodedMessage[1]) << 8) |
-                ((uint32_t)(encodedMessage[2]) << 16) |
-                ((uint32_t)(encodedMessage[3]) << 24);
-
-    *dataSize -= HEADER_SIZE;
-
-
-    *type = encodedMessage[4];
-
-    memcpy(data, encodedMessage + HEADER_SIZE, *dataSize);
-}
-
-void handleinput(char* input, uint8_t** finalMessage, uint32_t* messageSize) {
+MessageType handleinput(const char* input) {
     MessageType type = COMLINE; 
     if (strncmp(input, "QUITALL", 7) == 0) {
         type = QUITALL;
     } else if (strncmp(input, "QUIT", 4) == 0) {
         type = QUITREQ;
+    } else if (strcmp(input, "STATS\n") == 0 || strcmp(input, "STATS") == 0) {
+        type = STATSREQ;
     } else {
         type = COMLINE;
     }
+    return type;
+}
 
-    encode_message(type, input, strlen(input), finalMessage, messageSize);
+// Send cmd as a COMLINE tagged with id. The server may run several
+// commands of a session at once; their results carry the same id. The line
+// STATS asks for the server's metrics instead, which come back the same way.
+int send_command(int cs_fd, uint16_t id, const char* cmd) {
+    if (handleinput(cmd) == STATSREQ)
+        return send_message(cs_fd, STATSREQ, id, NULL, 0);
+    return send_message(cs_fd, COMLINE, id, cmd, strlen(cmd));
+}
+
+// Read the next COMRESULT frame, of whichever command, into frame. Returns
+// the size of its data, 0 for the end of that command's output, or -1 if
+// the connection broke.
+int read_frame(int sc_fd, int wsize, uint8_t* frame, uint16_t* id) {
+    uint8_t type;
+    uint32_t size;
+    if (read_message(sc_fd, packet, frame, wsize) == -1)
+        return -1;
+    decode_header(frame, &type, id, &size);
+    if (type != COMRESULT) {
+        fprintf(stderr, "Malformed result frame\n");
+        return -1;
+    }
+    return size;
+}
 
+// Listen on path for the server to connect the session's socket.
+int listen_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        perror("Could not create the session socket");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
 
+// Copy the output of command id to out until the empty frame that ends it.
+// Returns -1 if the connection broke.
+int read_result(int sc_fd, int wsize, uint16_t id, FILE* out) {
+    uint8_t frame[wsize];
+    uint16_t from;
+    while (1) {
+        int n = read_frame(sc_fd, wsize, frame, &from);
+        if (n == -1)
+            return -1;
+        if (from != id)
+            continue; // nothing else is in flight
+        if (n == 0)
+            return 0;
+        fwrite(frame + HEADER_SIZE, 1, n, out);
+    }
 }
 
+// A command of a batch that was sent and whose result is not out yet.
+struct batch_command {
+    char cmd[1024];
+    FILE* out;  // its own file, or a temporary one to print from
+    int done;
+};
+
+// Send the commands read from in without waiting for their results, with
+// up to BATCH_DEPTH in flight. The result of the n-th command goes to
+// outdir/n.out, or without outdir to stdout, in the order of the commands,
+// each after a line naming it. Returns how many commands ran, or -1 if
+// the connection broke.
+int run_batch(FILE* in, const char* outdir, int cs_fd, int sc_fd, int wsize) {
+    struct batch_command batch[BATCH_DEPTH];
+    uint8_t frame[wsize];
+    unsigned sent = 0, printed = 0;
+    int eof = 0;
+
+    while (!eof || printed < sent) {
+        while (!eof && sent - printed < BATCH_DEPTH) {
+            struct batch_command* b = &batch[(sent + 1) % BATCH_DEPTH];
+            if (fgets(b->cmd, sizeof(b->cmd), in) == NULL) {
+                eof = 1;
+                break;
+            }
+            if (outdir != NULL) {
+                char path[1024];
+                snprintf(path, sizeof(path), "%s/%u.out", outdir, sent + 1);
+                b->out = fopen(path, "w");
+            } else {
+                b->out = tmpfile();
+            }
+            if (b->out == NULL) {
+                perror("Could not open the result file");
+                return -1;
+            }
+            b->done = 0;
+            if (send_command(cs_fd, (uint16_t)(sent + 1), b->cmd) == -1)
+                return -1;
+            sent++;
+        }
+        if (printed == sent)
+            break;
+
+        // ids go up by one, so the window of them in flight maps onto batch
+        uint16_t id;
+        int n = read_frame(sc_fd, wsize, frame, &id);
+        if (n == -1)
+            return -1;
+        struct batch_command* b = &batch[id % BATCH_DEPTH];
+        if (n > 0)
+            fwrite(frame + HEADER_SIZE, 1, n, b->out);
+        else
+            b->done = 1;
+
+        while (printed < sent && batch[(printed + 1) % BATCH_DEPTH].done) {
+            b = &batch[(printed + 1) % BATCH_DEPTH];
+            if (outdir == NULL) {
+                char buf[8192];
+                size_t len;
+                b->cmd[strcspn(b->cmd, "\n")] = '\0';
+                printf("==> %u: %s <==\n", printed + 1, b->cmd);
+                rewind(b->out);
+                while ((len = fread(buf, 1, sizeof(buf), b->out)) > 0)
+                    fwrite(buf, 1, len, stdout);
+            }
+            fclose(b->out);
+            printed++;
+        }
+    }
+    fflush(stdout);
+    return sent;
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s /message_queue_name\n", argv[0]);
+    int transport = TRANSPORT_FIFO;
+    char* batch = NULL;
+    char* outdir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ub:o:")) != -1) {
+        if (opt == 'u')
+            transport = TRANSPORT_SOCKET;
+        else if (opt == 'b')
+            batch = optarg;
+        else if (opt == 'o')
+            outdir = optarg;
+        else
+            argc = 0; // show the usage
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if ((argc != 2 && argc != 3) || (outdir != NULL && batch == NULL)) {
+        fprintf(stderr, "Usage: comcli [-u] [-b file [-o dir]] /message_queue_name [wsize]\n");
+        fprintf(stderr, "       -u talks to the server over a unix socket instead of FIFOs\n");
+        fprintf(stderr, "       -b runs the commands in file (- for stdin) without waiting\n");
+        fprintf(stderr, "          for each result, and prints them each after a ==> line\n");
+        fprintf(stderr, "       -o writes the result of the n-th command to dir/n.out instead\n");
         exit(EXIT_FAILURE);
     }
     char* mqname = argv[1];
 
+    // in a batch, stdout is for the results
+    FILE* info = batch != NULL ? stderr : stdout;
+    FILE* in = stdin;
+    if (batch != NULL && strcmp(batch, "-") != 0) {
+        in = fopen(batch, "r");
+        if (in == NULL) {
+            perror("Could not open the batch file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     mqd_t mq;
     struct mq_attr mq_attr;
     int n;
@@ -93,83 +218,117 @@ int main(int argc, char* argv[]) {
         perror("mq_open");
         exit(EXIT_FAILURE);
     }
-    printf("mq opened, mq id = %d\n", (int) mq);
+    fprintf(info, "mq opened, mq id = %d\n", (int) mq);
 
     if (mq_getattr(mq, &mq_attr) == -1) {
         perror("Failed to get MQ attributes");
         exit(1);
     }
-    printf("MQ maximum msgsize = %ld\n", mq_attr.mq_msgsize);
+    fprintf(info, "MQ maximum msgsize = %ld\n", mq_attr.mq_msgsize);
 
     request.client_id = getpid();
+    request.transport = transport;
+    packet = transport == TRANSPORT_SOCKET;
 
-    sprintf(request.cs_pipe_name, "/tmp/cs_pipe_%d", getpid());
-    sprintf(request.sc_pipe_name, "/tmp/sc_pipe_%d", getpid());
-
-    char message[1024];
-    serialize_connection_request(&request,message);
-
-
-    uint8_t* finalMessage = NULL;
-    uint32_t messageSize = 0;
-
-    encode_message(CONREQUEST, message, sizeof(request), &finalMessage, &messageSize);
-
-
-    if (mq_send(mq, (char *)finalMessage, messageSize, 0) == -1) {
-        perror("MQ_send failed");
-        free(finalMessage);
+    if (packet) {
+        sprintf(request.cs_pipe_name, "/tmp/cs_sock_%d", getpid());
+        strcpy(request.sc_pipe_name, request.cs_pipe_name);
+    } else {
+        sprintf(request.cs_pipe_name, "/tmp/cs_pipe_%d", getpid());
+        sprintf(request.sc_pipe_name, "/tmp/sc_pipe_%d", getpid());
+    }
+    request.wsize = argc == 3 ? atoi(argv[2]) : DEFAULT_WSIZE;
+    if (request.wsize <= HEADER_SIZE || request.wsize > DEFAULT_WSIZE) {
+        fprintf(stderr, "wsize must be between %d and %d\n", HEADER_SIZE + 1, DEFAULT_WSIZE);
         exit(EXIT_FAILURE);
     }
 
-    free(finalMessage); 
-    
-
-    request.wsize = 1024;
-    if ( mkfifo(request.cs_pipe_name, 0666) == -1 && errno != EEXIST) {
+    // the pipes or socket have to exist before the server opens them
+    int listen_fd = -1;
+    if (packet) {
+        listen_fd = listen_socket(request.cs_pipe_name);
+    } else if ( mkfifo(request.cs_pipe_name, 0666) == -1 && errno != EEXIST) {
         perror("Could not create CS pipe");
         exit(EXIT_FAILURE);
     }
 
-    if (mkfifo(request.sc_pipe_name, 0666) == -1 && errno != EEXIST) {
+    if (!packet && mkfifo(request.sc_pipe_name, 0666) == -1 && errno != EEXIST) {
         perror("Could not create SC pipe");
         exit(EXIT_FAILURE);
     }
 
-    int cs_fd = open(request.cs_pipe_name,O_WRONLY);
-    if (cs_fd == -1) {
-        perror("open cs_pipe failed");
-        exit(EXIT_FAILURE);
-    }
+    // a message queue takes one buffer, so the request is put right
+    // behind its header
+    uint8_t finalMessage[HEADER_SIZE + 1024];
+    char* message = (char *)finalMessage + HEADER_SIZE;
+    serialize_connection_request(&request,message);
+    uint32_t messageSize = HEADER_SIZE + strlen(message) + 1;
+    encode_header(finalMessage, CONREQUEST, 0, messageSize - HEADER_SIZE);
 
-    int sc_fd = open(request.sc_pipe_name, O_RDONLY);
-    if (sc_fd == -1) {
-        perror("Could not open SC pipe for reading");
+    if (mq_send(mq, (char *)finalMessage, messageSize, 0) == -1) {
+        perror("MQ_send failed");
         exit(EXIT_FAILURE);
     }
 
+    int cs_fd, sc_fd;
+    if (packet) {
+        cs_fd = sc_fd = accept(listen_fd, NULL, NULL);
+        if (cs_fd == -1) {
+            perror("accept failed");
+            exit(EXIT_FAILURE);
+        }
+        close(listen_fd);
+        unlink(request.cs_pipe_name);
+    } else {
+        cs_fd = open(request.cs_pipe_name,O_WRONLY);
+        if (cs_fd == -1) {
+            perror("open cs_pipe failed");
+            exit(EXIT_FAILURE);
+        }
+
+        sc_fd = open(request.sc_pipe_name, O_RDONLY);
+        if (sc_fd == -1) {
+            perror("Could not open SC pipe for reading");
+            exit(EXIT_FAILURE);
+        }
+    }
 
 
 
 
-    char msg[1024];
-    char cmd[1024];
-    ssize_t num_bytes_read = read(sc_fd, msg, sizeof(msg) - 1); 
-    uint8_t receivedType = 0;
-    uint32_t receivedDataSize;
-    uint8_t receivedData[1024];
-    decode_message(msg, &receivedType, &receivedData, &receivedDataSize);
 
-    printf("Client: CONREPLY message received: cs=%s sc=%s, data= %s \n"
-            ,request.cs_pipe_name,request.sc_pipe_name,receivedData);
+    uint8_t msg[1024];
+    ssize_t num_bytes_read = read_message(sc_fd, packet, msg, sizeof(msg) - 1);
     if (num_bytes_read == -1) {
         perror("Error reading from SC pipe");
         exit(EXIT_FAILURE);
     }
+    uint8_t receivedType = 0;
+    uint16_t receivedId;
+    uint32_t receivedDataSize;
+    decode_header(msg, &receivedType, &receivedId, &receivedDataSize);
+    msg[num_bytes_read] = '\0';
+
+    fprintf(info, "Client: CONREPLY message received: cs=%s sc=%s, data= %s \n"
+            ,request.cs_pipe_name,request.sc_pipe_name,msg + HEADER_SIZE);
+
+    if (batch != NULL) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int count = run_batch(in, outdir, cs_fd, sc_fd, request.wsize);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (count == -1) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%d commands in %.3f s, %.0f commands/s\n", count, secs, count / secs);
+        mq_close(mq);
+        return 0;
+    }
 
+    uint16_t id = 0;
     while(1) {
-        uint32_t messageSize1 = 0;
-        uint8_t* finalMessagefork = NULL;
         char cmd[1024]; 
         printf("Type Command:");
         if (fgets(cmd, sizeof(cmd), stdin) == NULL) {
@@ -178,26 +337,20 @@ int main(int argc, char* argv[]) {
         }
 
 
-        //handleinput(cmd, &finalMessagefork, &messageSize1);
-
-        write(cs_fd, cmd, strlen(cmd) + 1);
+        if (send_command(cs_fd, ++id, cmd) == -1) {
+            printf("Could not send the command\n");
+            continue;
+        }
 
 
 
-        uint8_t* response[8192];
-        ssize_t lenr = read(sc_fd, response, sizeof(response) - 1);
-        if (lenr > 0) {
-            response[lenr] = '\0';
-            printf("Server Response:\n %s", response);
-        } else if (lenr == -1) {
-            printf("read from sc_fd failed");
-        } else {
+        printf("Server Response:\n ");
+        fflush(stdout);
+        if (read_result(sc_fd, request.wsize, id, stdout) == -1) {
             printf("Server closed the connection\n");
+            exit(EXIT_FAILURE);
         }
-
-
-
-        free(finalMessagefork);
+        fflush(stdout);
     }
 
     mq_close(mq);
@@ -0,0 +1,106 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "comcodec.h"
+
+// Fill in the HEADER_SIZE bytes in front of dataSize bytes of data.
+void encode_header(uint8_t* header, uint8_t type, uint16_t id, uint32_t dataSize) {
+    uint32_t messageSize = HEADER_SIZE + dataSize;
+    memset(header, 0, HEADER_SIZE);
+    header[0] = (uint8_t)(messageSize & 0xFF);
+    header[1] = (uint8_t)((messageSize >> 8) & 0xFF);
+    header[2] = (uint8_t)((messageSize >> 16) & 0xFF);
+    header[3] = (uint8_t)((messageSize >> 24) & 0xFF);
+    header[4] = type;
+    header[5] = (uint8_t)(id & 0xFF);
+    header[6] = (uint8_t)(id >> 8);
+}
+
+void decode_header(const uint8_t* buf, uint8_t* type, uint16_t* id, uint32_t* dataSize) {
+    *dataSize = ((uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+                 ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24)) - HEADER_SIZE;
+    *type = buf[4];
+    *id = buf[5] | (buf[6] << 8);
+}
+
+int write_all(int fd, const uint8_t* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send a message from the header on the stack and the data where it is,
+// without putting them together first. A single writev keeps it one
+// packet on a socket.
+int send_message(int fd, uint8_t type, uint16_t id, const void* data, size_t dataSize) {
+    uint8_t header[HEADER_SIZE];
+    struct iovec iov[2] = {{header, HEADER_SIZE}, {(void *)data, dataSize}};
+    struct iovec *v = iov;
+    int count = 2;
+
+    encode_header(header, type, id, dataSize);
+    while (count > 0) {
+        ssize_t n = writev(fd, v, count);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // a FIFO may take only part of it
+        for (; count > 0 && (size_t)n >= v->iov_len; v++, count--)
+            n -= v->iov_len;
+        if (count > 0) {
+            v->iov_base = (uint8_t *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int read_full(int fd, uint8_t* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read one message of at most size bytes into buf. A SOCK_SEQPACKET socket
+// hands over a whole message per read; a FIFO has no boundaries, so the
+// header is read first and then the rest. Returns the size of the message,
+// or -1 at the end of the connection or if it is malformed.
+ssize_t read_message(int fd, int packet, uint8_t* buf, size_t size) {
+    ssize_t n = HEADER_SIZE;
+    if (packet) {
+        while ((n = read(fd, buf, size)) == -1 && errno == EINTR)
+            ;
+        if (n < HEADER_SIZE)
+            return -1;
+    } else if (read_full(fd, buf, HEADER_SIZE) == -1) {
+        return -1;
+    }
+    uint32_t len = (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+                   ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+    if (len < HEADER_SIZE || len > size || (packet && len != (uint32_t)n))
+        return -1;
+    if (!packet && read_full(fd, buf + HEADER_SIZE, len - HEADER_SIZE) == -1)
+        return -1;
+    return len;
+}
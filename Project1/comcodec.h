@@ -0,0 +1,49 @@
+#ifndef COMCODEC_H
+#define COMCODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Messages between comcli and comserver: an 8 byte header, with the total
+// size little endian in bytes 0-3, the type in byte 4 and, for COMLINE,
+// STATSREQ and COMRESULT, the id of the command in bytes 5-6, then the data.
+// A STATSREQ, without data, is answered like a command, with the server's
+// metrics as its output.
+#define HEADER_SIZE 8
+
+typedef enum {
+    CONREQUEST = 1,
+    CONREPLY,
+    COMLINE,
+    COMRESULT,
+    QUITREQ,
+    QUITREPLY,
+    QUITALL,
+    STATSREQ
+} MessageType;
+
+// How the client talks to its session, chosen in the CONREQUEST. With a
+// socket, cs_pipe_name is the path of a SOCK_SEQPACKET socket the client
+// listens on, which carries both directions one message per packet.
+#define TRANSPORT_FIFO 0
+#define TRANSPORT_SOCKET 1
+struct connection_request {
+    int client_id;
+    char cs_pipe_name[64];
+    char sc_pipe_name[64];
+    int wsize;
+    int transport;
+};
+
+void encode_header(uint8_t* header, uint8_t type, uint16_t id, uint32_t dataSize);
+// The data of a message stays where it was read, at buf + HEADER_SIZE.
+void decode_header(const uint8_t* buf, uint8_t* type, uint16_t* id, uint32_t* dataSize);
+
+int write_all(int fd, const uint8_t* buf, size_t len);
+int send_message(int fd, uint8_t type, uint16_t id, const void* data, size_t dataSize);
+
+int read_full(int fd, uint8_t* buf, size_t len);
+ssize_t read_message(int fd, int packet, uint8_t* buf, size_t size);
+
+#endif
@@ -0,0 +1,298 @@
+// Server benchmark: nclients synthetic clients connect to comserver at the
+// same time and each, over its own session:
+//   - measures the CONREQUEST to CONREPLY handshake,
+//   - runs rounds of "echo x" one at a time for the round trip of a tiny
+//     result,
+//   - runs rounds / 10 + 1 of a command with a large output, by default
+//     1 MB from /dev/zero, one at a time,
+//   - runs rounds more "echo x" with up to PIPELINE_DEPTH in flight, for
+//     the commands per second the server sustains with all clients busy.
+// Results are printed as key=value lines, one per line, so that runs of
+// different builds can be compared with a script.
+//
+// usage: ./comsbench /message_queue_name nclients rounds [large_command]
+
+#include <stdlib.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "comcodec.h"
+
+#define WSIZE 65536
+#define TINY_COMMAND "echo x"
+#define LARGE_COMMAND "head -c 1048576 /dev/zero"
+// as many commands as a session runs at once
+#define PIPELINE_DEPTH 8
+
+// What one client measured, in the mmap shared with the parent.
+struct client_result {
+    double connect;
+    double sustained_start;
+    double sustained_end;
+    long large_bytes;
+    int errors;
+};
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Print the percentiles of the n latencies in lat that are not -1, as
+// name_ok, name_us_avg, name_us_p50 and so on.
+void report(const char *name, double *lat, int n) {
+    int ok = 0;
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        if (lat[i] >= 0) {
+            lat[ok++] = lat[i];
+            sum += lat[i];
+        }
+    }
+    printf("%s_ok=%d\n", name, ok);
+    if (ok == 0)
+        return;
+    qsort(lat, ok, sizeof(double), compare);
+    printf("%s_us_avg=%.1f\n", name, sum / ok);
+    printf("%s_us_p50=%.1f\n", name, lat[ok / 2]);
+    printf("%s_us_p90=%.1f\n", name, lat[ok * 90 / 100]);
+    printf("%s_us_p99=%.1f\n", name, lat[ok * 99 / 100]);
+    printf("%s_us_max=%.1f\n", name, lat[ok - 1]);
+}
+
+// Connect over a pair of FIFOs, as comcli does. Returns the handshake
+// latency in us, or -1.
+double connect_server(const char *mqname, char *cs, char *sc, int *cs_fd, int *sc_fd) {
+    struct connection_request request;
+    uint8_t msg[HEADER_SIZE + 1024];
+    char *data = (char *)msg + HEADER_SIZE;
+
+    sprintf(cs, "/tmp/sb_cs_%d", getpid());
+    sprintf(sc, "/tmp/sb_sc_%d", getpid());
+    if (mkfifo(cs, 0666) == -1 || mkfifo(sc, 0666) == -1) {
+        perror("mkfifo");
+        return -1;
+    }
+    mqd_t mq = mq_open(mqname, O_WRONLY);
+    if (mq == (mqd_t)-1) {
+        perror("mq_open");
+        return -1;
+    }
+    request.client_id = getpid();
+    strcpy(request.cs_pipe_name, cs);
+    strcpy(request.sc_pipe_name, sc);
+    request.wsize = WSIZE;
+    request.transport = TRANSPORT_FIFO;
+    int len = sprintf(data, "%d,%s,%s,%d,%d", request.client_id, request.cs_pipe_name,
+                      request.sc_pipe_name, request.wsize, request.transport) + 1;
+    encode_header(msg, CONREQUEST, 0, len);
+
+    double start = now_us();
+    if (mq_send(mq, (char *)msg, HEADER_SIZE + len, 0) == -1) {
+        perror("mq_send failed");
+        mq_close(mq);
+        return -1;
+    }
+    mq_close(mq);
+    *cs_fd = open(cs, O_WRONLY);
+    *sc_fd = open(sc, O_RDONLY);
+    if (*cs_fd == -1 || *sc_fd == -1 || read_message(*sc_fd, 0, msg, sizeof(msg)) == -1) {
+        fprintf(stderr, "Could not connect to the server\n");
+        return -1;
+    }
+    return now_us() - start;
+}
+
+// Read the next COMRESULT frame. Returns its data size, with the id of its
+// command in id, or -1 if the connection broke.
+int read_frame(int sc_fd, uint8_t *frame, uint16_t *id) {
+    uint8_t type;
+    uint32_t size;
+    if (read_message(sc_fd, 0, frame, WSIZE) == -1)
+        return -1;
+    decode_header(frame, &type, id, &size);
+    return type == COMRESULT ? (int)size : -1;
+}
+
+// Run cmd and wait for all of its output. Returns how many bytes came
+// back, or -1.
+long command(int cs_fd, int sc_fd, uint16_t id, const char *cmd) {
+    static uint8_t frame[WSIZE];
+    uint16_t from;
+    long bytes = 0;
+    int n;
+
+    if (send_message(cs_fd, COMLINE, id, cmd, strlen(cmd)) == -1)
+        return -1;
+    while ((n = read_frame(sc_fd, frame, &from)) != 0 || from != id) {
+        if (n == -1)
+            return -1;
+        bytes += n;
+    }
+    return bytes;
+}
+
+// Send count commands with up to PIPELINE_DEPTH of them in flight, and
+// wait for them all to finish. Returns -1 if the connection broke.
+int pipeline(int cs_fd, int sc_fd, uint16_t id, int count) {
+    static uint8_t frame[WSIZE];
+    int sent = 0, done = 0;
+    uint16_t from;
+
+    while (done < count) {
+        for (; sent < count && sent - done < PIPELINE_DEPTH; sent++)
+            if (send_message(cs_fd, COMLINE, id + sent, TINY_COMMAND, strlen(TINY_COMMAND)) == -1)
+                return -1;
+        int n = read_frame(sc_fd, frame, &from);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            done++;
+    }
+    return 0;
+}
+
+void client(const char *mqname, const char *large, int rounds, int nlarge,
+            struct client_result *result, double *tiny, double *bulk) {
+    char cs[64], sc[64];
+    int cs_fd = -1, sc_fd = -1;
+    uint16_t id = 0;
+
+    result->connect = connect_server(mqname, cs, sc, &cs_fd, &sc_fd);
+    if (result->connect < 0) {
+        result->errors++;
+        goto out;
+    }
+    for (int i = 0; i < rounds; i++) {
+        double start = now_us();
+        if (command(cs_fd, sc_fd, ++id, TINY_COMMAND) == -1) {
+            result->errors++;
+            goto out;
+        }
+        tiny[i] = now_us() - start;
+    }
+    for (int i = 0; i < nlarge; i++) {
+        double start = now_us();
+        long bytes = command(cs_fd, sc_fd, ++id, large);
+        if (bytes == -1) {
+            result->errors++;
+            goto out;
+        }
+        bulk[i] = now_us() - start;
+        result->large_bytes += bytes;
+    }
+    result->sustained_start = now_us();
+    if (pipeline(cs_fd, sc_fd, id + 1, rounds) == -1) {
+        result->errors++;
+        goto out;
+    }
+    result->sustained_end = now_us();
+out:
+    // closing cs ends the session
+    if (cs_fd != -1)
+        close(cs_fd);
+    if (sc_fd != -1)
+        close(sc_fd);
+    unlink(cs);
+    unlink(sc);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s /message_queue_name nclients rounds [large_command]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int nclients = atoi(argv[2]);
+    int rounds = atoi(argv[3]);
+    int nlarge = rounds / 10 + 1;
+    const char *large = argc == 5 ? argv[4] : LARGE_COMMAND;
+    if (nclients <= 0 || rounds <= 0) {
+        fprintf(stderr, "nclients and rounds must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // results, then latencies of the tiny commands, then of the large ones
+    size_t size = nclients * (sizeof(struct client_result) + (rounds + nlarge) * sizeof(double));
+    struct client_result *results = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    double *tiny = (double *)(results + nclients);
+    double *bulk = tiny + nclients * rounds;
+    for (int i = 0; i < nclients * rounds; i++)
+        tiny[i] = -1;
+    for (int i = 0; i < nclients * nlarge; i++)
+        bulk[i] = -1;
+
+    double start = now_us();
+    for (int c = 0; c < nclients; c++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            client(argv[1], large, rounds, nlarge, &results[c],
+                   tiny + c * rounds, bulk + c * nlarge);
+            exit(0);
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+    double elapsed = now_us() - start;
+
+    // sustained throughput is over the span in which any client pipelined
+    double *connect = malloc(nclients * sizeof(double));
+    double first = 0, last = 0;
+    long large_bytes = 0;
+    int errors = 0, sustained = 0;
+    for (int c = 0; c < nclients; c++) {
+        struct client_result *r = &results[c];
+        connect[c] = r->connect;
+        large_bytes += r->large_bytes;
+        errors += r->errors;
+        if (r->sustained_end > 0) {
+            if (sustained == 0 || r->sustained_start < first)
+                first = r->sustained_start;
+            if (r->sustained_end > last)
+                last = r->sustained_end;
+            sustained++;
+        }
+    }
+    double bulk_us = 0;
+    for (int i = 0; i < nclients * nlarge; i++)
+        if (bulk[i] >= 0)
+            bulk_us += bulk[i];
+
+    printf("clients=%d\n", nclients);
+    printf("rounds=%d\n", rounds);
+    printf("tiny_command=%s\n", TINY_COMMAND);
+    printf("large_command=%s\n", large);
+    printf("errors=%d\n", errors);
+    printf("elapsed_ms=%.1f\n", elapsed / 1000);
+    report("connect", connect, nclients);
+    report("tiny_rtt", tiny, nclients * rounds);
+    report("large_rtt", bulk, nclients * nlarge);
+    printf("large_bytes=%ld\n", large_bytes);
+    printf("large_mb_per_s=%.1f\n", bulk_us > 0 ? large_bytes / bulk_us : 0);
+    printf("sustained_commands=%d\n", sustained * rounds);
+    printf("sustained_commands_per_s=%.0f\n", last > first ? sustained * rounds / ((last - first) / 1e6) : 0);
+    free(connect);
+    return errors > 0 ? EXIT_FAILURE : 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <mqueue.h>
 #include <stdio.h>
@@ -7,325 +8,1639 @@
 #include <string.h>
 #include <stdint.h>
 #include <fcntl.h>  
+#include <signal.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <locale.h>
+#include <langinfo.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "comcodec.h"
 
 
 #define MAX_ARGS 10
+#define MAX_STAGES 16
+// commands in one pipeline
 #define BUFFER_SIZE 1024
-#define HEADER_SIZE 8 
-typedef enum {
-    CONREQUEST = 1,
-    CONREPLY,
-    COMLINE,
-    COMRESULT,
-    QUITREQ,
-    QUITREPLY,
-    QUITALL
-} MessageType;
-struct connection_request {
-    int client_id;
-    char cs_pipe_name[64];
-    char sc_pipe_name[64];
-    int wsize;
+#define MAX_WSIZE 65536
+// largest frame a client can ask for, the default capacity of a pipe
+#define MAX_INFLIGHT 8
+// commands of one session that run at the same time
+
+
+void parse_command(char* cmd, char* args[] ) {
+    int i = 0;
+    char *token = strtok(cmd, " ");
+    while (token != NULL && i < MAX_ARGS) {
+        args[i++] = token;
+        token = strtok(NULL, " ");
+    }
+    args[i] = NULL; 
+}
+
+// Server metrics, in shared memory so that every process of the server adds
+// to the same counters. They are printed with the stats on SIGUSR1 and sent
+// to a client that asks with a STATSREQ.
+#define HIST_BUCKETS 32
+
+// Times in us; bucket i counts those below 2^i us that are not below
+// 2^(i-1), and the last one everything longer.
+struct histogram {
+    long count;
+    long sum;
+    long buckets[HIST_BUCKETS];
+};
+
+struct server_metrics {
+    long sessions;          // opened since the start
+    long active_sessions;
+    long commands;          // command lines received
+    long running;           // of them, not finished yet
+    long builtins;          // run inside the session, without a process
+    long bytes;             // of output sent to clients
+    long stages[MAX_STAGES + 1]; // command lines by how many commands
+    struct histogram spawn; // posix_spawn of one command
+    struct histogram wall;  // command line received to the end of its output
 };
 
+struct server_metrics *metrics;
 
-void encode_message(uint8_t type, const void* data, size_t dataSize, uint8_t** encodedMessage, uint32_t* messageSize) {
-    *messageSize = HEADER_SIZE + dataSize; 
-    *encodedMessage = malloc(*messageSize);
+// What one session did, printed when it closes.
+struct session_metrics {
+    long commands;
+    long bytes;
+    long wall;  // us
+};
 
+struct session_metrics *session_metrics;
 
-    (*encodedMessage)[0] = (uint8_t)(*messageSize & 0xFF);
-    (*encodedMessage)[1] = (uint8_t)((*messageSize >> 8) & 0xFF);
-    (*encodedMessage)[2] = (uint8_t)((*messageSize >> 16) & 0xFF);
-    (*encodedMessage)[3] = (uint8_t)((*messageSize >> 24) & 0xFF);
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
 
-    (*encodedMessage)[4] = type;
+void record(struct histogram *h, long us) {
+    int i = 0;
+    while (i < HIST_BUCKETS - 1 && us >= 1L << i)
+        i++;
+    __sync_fetch_and_add(&h->count, 1);
+    __sync_fetch_and_add(&h->sum, us);
+    __sync_fetch_and_add(&h->buckets[i], 1);
+}
 
+// Output sent to the client of the session at hand.
+void count_output(long n) {
+    __sync_fetch_and_add(&metrics->bytes, n);
+    if (session_metrics != NULL)
+        __sync_fetch_and_add(&session_metrics->bytes, n);
+}
 
-    memcpy(*encodedMessage + HEADER_SIZE, data, dataSize);
+// Upper bound of the bucket in which the fraction p of the times end.
+long percentile(struct histogram *h, double p) {
+    long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= p * h->count)
+            return 1L << i;
+    }
+    return 1L << (HIST_BUCKETS - 1);
 }
 
-void decode_message(const uint8_t* encodedMessage, uint8_t* type, void* data, uint32_t* dataSize) {
-    if (encodedMessage == NULL || type == NULL || data == NULL || dataSize == NULL) {
-        fprintf(stderr, "Invalid argument to decode_message\n");
+void print_histogram(FILE *out, const char *name, struct histogram *h) {
+    struct histogram copy = *h; // the counters keep moving
+    if (copy.count == 0) {
+        fprintf(out, "%s: none\n", name);
         return;
     }
+    fprintf(out, "%s: %ld, avg %ld us, p50 < %ld us, p90 < %ld us, p99 < %ld us\n",
+            name, copy.count, copy.sum / copy.count, percentile(&copy, 0.5),
+            percentile(&copy, 0.9), percentile(&copy, 0.99));
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (copy.buckets[i] == 0)
+            continue;
+        if (i < HIST_BUCKETS - 1)
+            fprintf(out, "    < %ld us: %ld\n", 1L << i, copy.buckets[i]);
+        else
+            fprintf(out, "    >= %ld us: %ld\n", 1L << (i - 1), copy.buckets[i]);
+    }
+}
 
-    *dataSize = (uint32_t)(encodedMessage[0]) |
-                ((uint32_t)(encodedMessage[1]) << 8) |
-                ((uint32_t)(encodedMessage[2]) << 16) |
-                ((uint32_t)(encodedMessage[3]) << 24);
+void print_metrics(FILE *out) {
+    fprintf(out, "Sessions: %ld active, %ld opened\n", metrics->active_sessions, metrics->sessions);
+    fprintf(out, "Commands: %ld received, %ld running, %ld as builtins, %ld bytes of output\n",
+            metrics->commands, metrics->running, metrics->builtins, metrics->bytes);
+    fprintf(out, "Commands per pipeline:");
+    for (int i = 1; i <= MAX_STAGES; i++)
+        if (metrics->stages[i] > 0)
+            fprintf(out, " %d: %ld", i, metrics->stages[i]);
+    fprintf(out, "\n");
+    print_histogram(out, "Spawn time", &metrics->spawn);
+    print_histogram(out, "Command wall time", &metrics->wall);
+}
 
-    *dataSize -= HEADER_SIZE;
+void print_session(FILE *out, int client_id, struct session_metrics *m) {
+    fprintf(out, "Session of client %d: %ld commands, %ld bytes of output, %ld ms in commands\n",
+            client_id, m->commands, m->bytes, m->wall / 1000);
+}
 
-    *type = encodedMessage[4];
+// Frames of command output are at most wsize bytes including the header.
+// A COMRESULT frame without data ends the output of a command.
 
-    memcpy(data, encodedMessage + HEADER_SIZE, *dataSize);
-}
+// Send the dataSize bytes after the header room at the start of frame.
+// While a command's output is being kept for the result cache, everything
+// sent is also copied here.
+struct capture {
+    char *data;
+    int len;
+    int size;
+    int overflow; // more output than fits, or an error: not cached
+};
 
+struct capture *capture;
 
-void parse_command(char* cmd, char* args[] ) {
-    int i = 0;
-    char *token = strtok(cmd, " ");
-    while (token != NULL && i < MAX_ARGS) {
-        args[i++] = token;
-        token = strtok(NULL, " ");
+// Frames are tagged with the id of the command whose output they carry.
+// The session writes whole frames only, so that frames of commands that
+// run at the same time do not mix.
+uint16_t command_id;
+
+int send_frame(int sc_fd, uint8_t* frame, uint32_t dataSize) {
+    if (capture != NULL && !capture->overflow) {
+        if (capture->len + (int)dataSize > capture->size) {
+            capture->overflow = 1;
+        } else {
+            memcpy(capture->data + capture->len, frame + HEADER_SIZE, dataSize);
+            capture->len += dataSize;
+        }
     }
-    args[i] = NULL; 
+    encode_header(frame, COMRESULT, command_id, dataSize);
+    int status = write_all(sc_fd, frame, HEADER_SIZE + dataSize);
+    if (status == 0)
+        count_output(dataSize);
+    return status;
 }
 
-char* childserver(struct connection_request *request,char*cmd) {
-    char *returnval = NULL;
-    char *args1[MAX_ARGS + 1];
-    char *args2[MAX_ARGS + 1];
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        exit(EXIT_FAILURE);
+// Send text as the whole output of a command.
+int send_result(int sc_fd, int wsize, const char* text) {
+    uint8_t frame[wsize];
+    size_t len = strlen(text);
+    while (len > 0) {
+        uint32_t n = len < (size_t)(wsize - HEADER_SIZE) ? len : wsize - HEADER_SIZE;
+        memcpy(frame + HEADER_SIZE, text, n);
+        if (send_frame(sc_fd, frame, n) == -1)
+            return -1;
+        text += n;
+        len -= n;
     }
-    pid_t cpid1, cpid2;
+    return send_frame(sc_fd, frame, 0);
+}
 
-    if (cmd == NULL) {
-        printf("Error reading command.\n");
-        exit(EXIT_FAILURE);
+// Output of a builtin, sent in frames of at most wsize bytes.
+struct result_stream {
+    int sc_fd;
+    int wsize;
+    int len;          // data waiting in frame
+    int status;       // -1 once the client went away
+    uint8_t *frame;
+};
+
+void stream_write(struct result_stream *out, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0 && out->status == 0) {
+        size_t n = out->wsize - HEADER_SIZE - out->len;
+        if (n > len)
+            n = len;
+        memcpy(out->frame + HEADER_SIZE + out->len, p, n);
+        out->len += n;
+        p += n;
+        len -= n;
+        if (out->len == out->wsize - HEADER_SIZE) {
+            out->status = send_frame(out->sc_fd, out->frame, out->len);
+            out->len = 0;
+        }
     }
+}
 
-    cmd[strcspn(cmd, "\n")] = 0;
-    FILE* tmpf = tmpfile();
-    int stdoutCopy = dup(fileno(stdout));
-    dup2 (fileno(tmpf), fileno(stdout));
+// Commands that are common enough to be run inside the session instead of
+// by starting a process. They print exactly what the real command prints.
+// Anything they do not handle the same way, an option or an error, makes
+// them return BUILTIN_EXEC before printing anything, and the real command
+// is run instead.
+#define BUILTIN_EXEC 1
 
-    if (strchr(cmd, '|') != NULL) {
-        char *part1 = strtok(cmd, "|");
-        char *part2 = strtok(NULL, "");
+int builtin_echo(char **argv, struct result_stream *out) {
+    if (argv[1] != NULL && argv[1][0] == '-')
+        return BUILTIN_EXEC;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (i > 1)
+            stream_write(out, " ", 1);
+        stream_write(out, argv[i], strlen(argv[i]));
+    }
+    stream_write(out, "\n", 1);
+    return 0;
+}
 
-        if (part1 == NULL || part2 == NULL) {
-            printf("Error: Invalid command format.\n");
-            exit(EXIT_FAILURE);
+int builtin_pwd(char **argv, struct result_stream *out) {
+    char cwd[4096];
+    if (argv[1] != NULL || getcwd(cwd, sizeof(cwd)) == NULL)
+        return BUILTIN_EXEC;
+    strcat(cwd, "\n");
+    stream_write(out, cwd, strlen(cwd));
+    return 0;
+}
+
+int builtin_date(char **argv, struct result_stream *out) {
+    char buf[256];
+    time_t now = time(NULL);
+    struct tm tm;
+    // the format date uses without arguments
+    if (argv[1] != NULL || localtime_r(&now, &tm) == NULL)
+        return BUILTIN_EXEC;
+    size_t len = strftime(buf, sizeof(buf) - 1, nl_langinfo(_DATE_FMT), &tm);
+    if (len == 0)
+        return BUILTIN_EXEC;
+    buf[len++] = '\n';
+    stream_write(out, buf, len);
+    return 0;
+}
+
+int builtin_cat(char **argv, struct result_stream *out) {
+    int fds[MAX_ARGS];
+    int nfiles = 0;
+    struct stat st;
+
+    // open them all first so that an error can still go to the real cat
+    for (int i = 1; argv[i] != NULL; i++) {
+        int fd = -1;
+        if (argv[i][0] != '-')
+            fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode))) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            while (nfiles > 0)
+                close(fds[--nfiles]);
+            return BUILTIN_EXEC;
         }
+        fds[nfiles++] = fd;
+    }
+    if (nfiles == 0)
+        return BUILTIN_EXEC; // would read stdin
 
-        parse_command(part1, args1);
-        parse_command(part2, args2);
+    char buf[BUFFER_SIZE * 16];
+    for (int i = 0; i < nfiles; i++) {
+        ssize_t n;
+        while ((n = read(fds[i], buf, sizeof(buf))) > 0)
+            stream_write(out, buf, n);
+        if (n == -1) {
+            // too late for the real cat, part of the file is already out
+            char err[BUFFER_SIZE + 64];
+            int len = snprintf(err, sizeof(err), "cat: %s: %s\n", argv[i + 1], strerror(errno));
+            stream_write(out, err, len);
+            if (capture != NULL)
+                capture->overflow = 1;
+        }
+        close(fds[i]);
+    }
+    return 0;
+}
 
+int builtin_wc(char **argv, struct result_stream *out) {
+    // only wc -l FILE
+    if (argv[1] == NULL || strcmp(argv[1], "-l") != 0 || argv[2] == NULL ||
+        argv[2][0] == '-' || argv[3] != NULL)
+        return BUILTIN_EXEC;
+    int fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1)
+        return BUILTIN_EXEC;
+    if (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode)) {
+        close(fd);
+        return BUILTIN_EXEC;
+    }
 
+    char buf[BUFFER_SIZE * 16];
+    unsigned long lines = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+            lines++;
+    }
+    close(fd);
+    if (n == -1)
+        return BUILTIN_EXEC;
 
-        cpid1 = fork();
-        if (cpid1 == -1) {
-            perror("fork");
-            exit(EXIT_FAILURE);
+    char line[BUFFER_SIZE + 32];
+    int len = snprintf(line, sizeof(line), "%lu %s\n", lines, argv[2]);
+    stream_write(out, line, len);
+    return 0;
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+int builtin_ls(char **argv, struct result_stream *out) {
+    // only ls and ls DIR, which print the names one per line when the
+    // output is not a terminal
+    const char *path = argv[1] != NULL ? argv[1] : ".";
+    if (path[0] == '-' || (argv[1] != NULL && argv[2] != NULL))
+        return BUILTIN_EXEC;
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return BUILTIN_EXEC;
+
+    char **names = NULL;
+    int count = 0, size = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            char **grown = realloc(names, size * sizeof(char *));
+            if (grown == NULL)
+                break;
+            names = grown;
         }
+        char *name = strdup(de->d_name);
+        if (name == NULL)
+            break;
+        names[count++] = name;
+    }
+    closedir(dir);
+    if (de != NULL) {
+        while (count > 0)
+            free(names[--count]);
+        free(names);
+        return BUILTIN_EXEC;
+    }
 
-        if (cpid1 == 0) { 
-            close(pipefd[0]); 
-            dup2(pipefd[1], STDOUT_FILENO); 
-            close(pipefd[1]);
+    qsort(names, count, sizeof(char *), compare_names);
+    for (int i = 0; i < count; i++) {
+        stream_write(out, names[i], strlen(names[i]));
+        stream_write(out, "\n", 1);
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
 
-            execvp(args1[0], args1);
-            perror("execvp args1");
-            exit(EXIT_FAILURE);
-        } else {
-            cpid2 = fork();
-            if (cpid2 == -1) {
-                perror("fork");
-                exit(EXIT_FAILURE);
-            }
+struct builtin {
+    const char *name;
+    int (*run)(char **argv, struct result_stream *out);
+};
 
-            if (cpid2 == 0) { 
-                close(pipefd[1]); 
-                dup2(pipefd[0], STDIN_FILENO); 
-                close(pipefd[0]);
+struct builtin builtins[] = {
+    {"echo", builtin_echo},
+    {"pwd", builtin_pwd},
+    {"date", builtin_date},
+    {"cat", builtin_cat},
+    {"wc", builtin_wc},
+    {"ls", builtin_ls},
+    {NULL, NULL}
+};
 
-                execvp(args2[0], args2);
-                perror("execvp args2");
-                exit(EXIT_FAILURE);
-            } else {
-                close(pipefd[0]);
-                close(pipefd[1]);
-                wait(NULL);
-                wait(NULL);
-                rewind(tmpf);
-                dup2(stdoutCopy, fileno(stdout));
-
-                char *buffer = NULL;
-                size_t len;
-                ssize_t bytes_read = getdelim(&buffer, &len, '\0', tmpf);
-
-                if (bytes_read != -1) {
-                    returnval = buffer;
-                    close(stdoutCopy);
-                }
+// Run argv as a builtin if there is one for it. Returns BUILTIN_EXEC if it
+// has to be run as a process, otherwise 0, or -1 if the client went away.
+int run_builtin(char **argv, int sc_fd, int wsize) {
+    for (struct builtin *b = builtins; b->name != NULL; b++) {
+        if (strcmp(argv[0], b->name) != 0)
+            continue;
+
+        uint8_t frame[wsize];
+        struct result_stream out = {sc_fd, wsize, 0, 0, frame};
+        if (b->run(argv, &out) == BUILTIN_EXEC)
+            return BUILTIN_EXEC;
+        __sync_fetch_and_add(&metrics->builtins, 1);
+        if (out.status == 0 && out.len > 0)
+            out.status = send_frame(sc_fd, frame, out.len);
+        if (out.status == 0)
+            out.status = send_frame(sc_fd, frame, 0);
+        return out.status;
+    }
+    return BUILTIN_EXEC;
+}
+
+// Result cache, enabled with -c ttl. The output of command lines made only
+// of read-only commands is kept for ttl seconds, shared by all sessions,
+// keyed by the command line with its words separated by single spaces. The
+// arguments that name files are stat'ed when the output is kept and again
+// on each hit, and a change of any of them drops the entry.
+#define CACHE_ENTRIES 64
+#define CACHE_DATA_SIZE 16384
+#define CACHE_FILES 8
+
+const char *cacheable[] = {
+    "cat", "ls", "head", "tail", "wc", "grep", "sort", "uniq", "cut",
+    "stat", "du", "df", "uname", "file", "md5sum", "sha1sum", NULL
+};
+
+struct cache_file {
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+struct cache_entry {
+    int used;
+    time_t expires;
+    unsigned long last_used;
+    char key[BUFFER_SIZE];
+    int nfiles;
+    struct cache_file files[CACHE_FILES];
+    int len;
+    char data[CACHE_DATA_SIZE];
+};
+
+struct result_cache {
+    sem_t lock;
+    int ttl;
+    unsigned long clock;
+    long hits;
+    long misses;
+    long stores;
+    long invalidations;  // entries dropped because a file changed
+    struct cache_entry entries[CACHE_ENTRIES];
+};
+
+struct result_cache *cache; // NULL unless enabled
+
+// Key of a command line, and the state of the files it names. Returns -1 if
+// its output must not be cached.
+int cache_key(char *args[][MAX_ARGS + 1], int nstages, char *key, struct cache_file *files, int *nfiles) {
+    int len = 0;
+    *nfiles = 0;
+    for (int i = 0; i < nstages; i++) {
+        int ok = 0;
+        for (const char **c = cacheable; *c != NULL && !ok; c++)
+            ok = strcmp(args[i][0], *c) == 0;
+        if (!ok)
+            return -1;
+
+        for (int j = 0; args[i][j] != NULL; j++) {
+            int n = snprintf(key + len, BUFFER_SIZE - len, "%s%s", len ? (j ? " " : " | ") : "", args[i][j]);
+            if (n >= BUFFER_SIZE - len)
+                return -1;
+            len += n;
+            if (j == 0 || args[i][j][0] == '-')
+                continue;
+
+            // anything that is not an option may be a file
+            struct stat st;
+            struct cache_file *f = &files[*nfiles];
+            if ((*nfiles)++ == CACHE_FILES)
+                return -1;
+            memset(f, 0, sizeof(*f));
+            if (stat(args[i][j], &st) == 0) {
+                f->exists = 1;
+                f->dev = st.st_dev;
+                f->ino = st.st_ino;
+                f->size = st.st_size;
+                f->mtime = st.st_mtim;
             }
         }
+    }
+    return 0;
+}
+
+// Send the output kept for key if it is still good. Returns 1 if it was
+// sent, 0 on a miss and -1 if the client went away.
+int cache_lookup(const char *key, struct cache_file *files, int nfiles, int sc_fd, int wsize) {
+    struct cache_entry *e = NULL;
+    char data[CACHE_DATA_SIZE];
+    int len = 0;
+
+    sem_wait(&cache->lock);
+    for (int i = 0; i < CACHE_ENTRIES && e == NULL; i++) {
+        if (cache->entries[i].used && strcmp(cache->entries[i].key, key) == 0)
+            e = &cache->entries[i];
+    }
+    if (e != NULL && (e->expires < time(NULL) || e->nfiles != nfiles ||
+                      memcmp(e->files, files, nfiles * sizeof(struct cache_file)) != 0)) {
+        if (e->expires >= time(NULL))
+            cache->invalidations++;
+        e->used = 0;
+        e = NULL;
+    }
+    if (e == NULL) {
+        cache->misses++;
     } else {
-        parse_command(cmd, args1);
+        cache->hits++;
+        e->last_used = ++cache->clock;
+        len = e->len;
+        memcpy(data, e->data, len);
+    }
+    sem_post(&cache->lock);
+    if (e == NULL)
+        return 0;
 
-        cpid1 = fork();
-        if (cpid1 == -1) {
-            perror("fork");
-            exit(EXIT_FAILURE);
+    uint8_t frame[wsize];
+    for (int off = 0; off < len; ) {
+        int n = len - off < wsize - HEADER_SIZE ? len - off : wsize - HEADER_SIZE;
+        memcpy(frame + HEADER_SIZE, data + off, n);
+        if (send_frame(sc_fd, frame, n) == -1)
+            return -1;
+        off += n;
+    }
+    return send_frame(sc_fd, frame, 0) == -1 ? -1 : 1;
+}
+
+// Keep the output of a command, replacing the least recently used entry if
+// the cache is full.
+void cache_store(const char *key, struct cache_file *files, int nfiles, struct capture *out) {
+    sem_wait(&cache->lock);
+    struct cache_entry *e = &cache->entries[0];
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *c = &cache->entries[i];
+        if (!c->used || strcmp(c->key, key) == 0) {
+            e = c;
+            break;
+        }
+        if (c->last_used < e->last_used)
+            e = c;
+    }
+    e->used = 1;
+    e->expires = time(NULL) + cache->ttl;
+    e->last_used = ++cache->clock;
+    strcpy(e->key, key);
+    e->nfiles = nfiles;
+    memcpy(e->files, files, nfiles * sizeof(struct cache_file));
+    e->len = out->len;
+    memcpy(e->data, out->data, out->len);
+    cache->stores++;
+    sem_post(&cache->lock);
+}
+
+// Start argv with in_fd, out_fd and err_fd as its stdin, stdout and stderr
+// (in_fd -1 keeps the session's stdin). posix_spawn does not copy the page
+// tables of the session like fork does. Returns the pid, or -1 with errno
+// set if the command could not be started.
+pid_t launch(char **argv, int in_fd, int out_fd, int err_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigdefault;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+    // the session ignores SIGPIPE, commands should die of it as usual
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    long start = now_us();
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    record(&metrics->spawn, now_us() - start);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+// Move what is waiting in out_fd to the sc FIFO as one frame with splice,
+// so that it does not pass through the session's memory; only the frame
+// header is written from here. How much is waiting in the pipe gives the
+// size of the frame. Returns its size, 0 once all the commands closed their
+// output, or -1 if the client went away.
+int splice_frame(int out_fd, int sc_fd, int wsize) {
+    uint8_t header[HEADER_SIZE];
+    int avail;
+
+    if (ioctl(out_fd, FIONREAD, &avail) == -1) {
+        perror("FIONREAD failed");
+        return 0;
+    }
+    if (avail == 0)
+        return 0;
+
+    int n = avail < wsize - HEADER_SIZE ? avail : wsize - HEADER_SIZE;
+    encode_header(header, COMRESULT, command_id, n);
+    int status = write_all(sc_fd, header, HEADER_SIZE);
+    if (status == 0)
+        count_output(n);
+    for (int left = n; status == 0 && left > 0; ) {
+        ssize_t moved = splice(out_fd, NULL, sc_fd, NULL, left, SPLICE_F_MOVE);
+        if (moved == -1 && errno != EINTR)
+            status = -1;
+        else if (moved > 0)
+            left -= moved;
+    }
+    return status == -1 ? -1 : n;
+}
+
+// Split cmd into the argument lists of the commands of its pipeline.
+// Returns how many there are, or 0 with error set to what to answer.
+int parse_pipeline(char *cmd, char *args[][MAX_ARGS + 1], const char **error) {
+    char *stages[MAX_STAGES];
+    int nstages = 0;
+
+    cmd[strcspn(cmd, "\n")] = 0;
+    for (char *p = cmd; p != NULL; ) {
+        if (nstages == MAX_STAGES) {
+            *error = "Error: Too many commands in the pipeline.\n";
+            return 0;
+        }
+        stages[nstages++] = p;
+        p = strchr(p, '|');
+        if (p != NULL)
+            *p++ = '\0';
+    }
+    for (int i = 0; i < nstages; i++) {
+        parse_command(stages[i], args[i]);
+        if (args[i][0] == NULL) {
+            *error = nstages == 1 ? "" : "Error: Invalid command format.\n";
+            return 0;
+        }
+    }
+    return nstages;
+}
+
+// Start all the commands of a pipeline, each reading the output of the one
+// before it. What the last writes to stdout, and what any of them writes to
+// stderr, goes to out_fd. Their pids go to pids; returns how many started.
+int spawn_pipeline(char *args[][MAX_ARGS + 1], int nstages, int out_fd, pid_t *pids) {
+    int npids = 0;
+    int prev_read = -1;
+    for (int i = 0; i < nstages; i++) {
+        int next[2] = {-1, -1};
+        if (i < nstages - 1 && pipe2(next, O_CLOEXEC) == -1) {
+            perror("pipe");
+            break;
         }
 
-        if (cpid1 == 0) {
-            execvp(args1[0], args1);
-            perror("execvp single command");
-            exit(EXIT_FAILURE);
+        pid_t pid = launch(args[i], prev_read, i < nstages - 1 ? next[1] : out_fd, out_fd);
+        if (pid == -1) {
+            // the next stage just sees an empty input, as with a shell
+            char err[BUFFER_SIZE];
+            int len = snprintf(err, sizeof(err), "%s: %s\n", args[i][0], strerror(errno));
+            write(out_fd, err, len);
         } else {
-            wait(NULL); 
-            rewind(tmpf);
-            dup2(stdoutCopy, fileno(stdout));
-
-            size_t len;
-            ssize_t bytes_read = getdelim(&returnval, &len, '\0', tmpf);
-            if (bytes_read != -1) {
-                close(stdoutCopy);
-            }
-            close(stdoutCopy);
-            close(fileno(tmpf));
+            pids[npids++] = pid;
         }
+
+        if (prev_read != -1)
+            close(prev_read);
+        if (next[1] != -1)
+            close(next[1]);
+        prev_read = next[0];
     }
-    return returnval;
+    if (prev_read != -1)
+        close(prev_read);
+    return npids;
+}
+
+// A command line of a worker session whose pipeline is running. The
+// session polls out_fd with cs and sends what comes out as it comes.
+struct session_command {
+    uint16_t id;
+    int out_fd;             // read end of the output of its pipeline, -1 if free
+    long start;             // us, when it was received
+    int cached;             // its output is kept for the result cache
+    char key[BUFFER_SIZE];
+    struct cache_file files[CACHE_FILES];
+    int nfiles;
+    struct capture capture;
+    char data[CACHE_DATA_SIZE];
+};
+
+struct session_command session_commands[MAX_INFLIGHT];
+int nsession_commands;
+
+// A command line received at start has been answered.
+void line_done(long start) {
+    long wall = now_us() - start;
+    record(&metrics->wall, wall);
+    session_metrics->wall += wall;
+}
+
+void end_command(struct session_command *c) {
+    close(c->out_fd);
+    c->out_fd = -1;
+    nsession_commands--;
+    __sync_fetch_and_sub(&metrics->running, 1);
 }
 
+// Run the command line cmd with the given id. A builtin, a cache hit or an
+// error is answered at once; a pipeline is started with its output going
+// to a free slot of session_commands. Returns -1 if the client went away.
+int start_line(struct connection_request *request, uint16_t id, char *cmd, int sc_fd) {
+    char *args[MAX_STAGES][MAX_ARGS + 1];
+    pid_t pids[MAX_STAGES];
+    const char *error;
+
+    long start = now_us();
+    command_id = id;
+    __sync_fetch_and_add(&metrics->commands, 1);
+    session_metrics->commands++;
+    int nstages = parse_pipeline(cmd, args, &error);
+    if (nstages == 0)
+        return send_result(sc_fd, request->wsize, error);
+    __sync_fetch_and_add(&metrics->stages[nstages], 1);
+
+    struct session_command *c = session_commands;
+    while (c->out_fd != -1)
+        c++;
+    c->cached = cache != NULL && cache_key(args, nstages, c->key, c->files, &c->nfiles) == 0;
+    if (c->cached) {
+        int status = cache_lookup(c->key, c->files, c->nfiles, sc_fd, request->wsize);
+        if (status != 0) {
+            line_done(start);
+            return status == 1 ? 0 : -1;
+        }
+    }
+    c->capture = (struct capture){c->data, 0, sizeof(c->data), 0};
+    if (nstages == 1) {
+        capture = c->cached ? &c->capture : NULL;
+        int status = run_builtin(args[0], sc_fd, request->wsize);
+        capture = NULL;
+        if (status != BUILTIN_EXEC) {
+            if (status == 0 && c->cached && !c->capture.overflow)
+                cache_store(c->key, c->files, c->nfiles, &c->capture);
+            line_done(start);
+            return status;
+        }
+    }
+
+    // everything the commands print comes back through outfd; all pipes are
+    // close-on-exec so that each command keeps only its stdin and stdout
+    int outfd[2];
+    if (pipe2(outfd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return send_result(sc_fd, request->wsize, "");
+    }
+    spawn_pipeline(args, nstages, outfd[1], pids);
+    close(outfd[1]);
+
+    c->id = id;
+    c->out_fd = outfd[0];
+    c->start = start;
+    nsession_commands++;
+    __sync_fetch_and_add(&metrics->running, 1);
+    return 0;
+}
+
+// Send what the pipeline of c wrote next as a frame, or the empty frame
+// that ends its output. FIFO sessions get the output spliced, unless the
+// result cache has to see it; a socket needs each frame in a single write.
+// Returns -1 if the client went away.
+int command_output(struct session_command *c, struct connection_request *request, int sc_fd) {
+    uint8_t frame[request->wsize];
+    ssize_t n;
+
+    command_id = c->id;
+    if (request->transport == TRANSPORT_FIFO && !c->cached) {
+        n = splice_frame(c->out_fd, sc_fd, request->wsize);
+        if (n != 0)
+            return n == -1 ? -1 : 0;
+    } else {
+        while ((n = read(c->out_fd, frame + HEADER_SIZE, request->wsize - HEADER_SIZE)) == -1 && errno == EINTR)
+            ;
+        if (n == -1) {
+            perror("read from command failed");
+            n = 0;
+        }
+        if (n > 0) {
+            capture = c->cached ? &c->capture : NULL;
+            int status = send_frame(sc_fd, frame, n);
+            capture = NULL;
+            return status;
+        }
+    }
+
+    if (c->cached && !c->capture.overflow)
+        cache_store(c->key, c->files, c->nfiles, &c->capture);
+    end_command(c);
+    line_done(c->start);
+    return send_frame(sc_fd, frame, 0);
+}
+
+
+
+void show_stats(FILE *out) {
+    print_metrics(out);
+    if (cache == NULL) {
+        fprintf(out, "Result cache is off\n");
+    } else {
+        sem_wait(&cache->lock);
+        int entries = 0;
+        for (int i = 0; i < CACHE_ENTRIES; i++)
+            entries += cache->entries[i].used;
+        fprintf(out, "Result cache: %ld hits, %ld misses, %ld stored, %ld invalidated, %d entries\n",
+                cache->hits, cache->misses, cache->stores, cache->invalidations, entries);
+        sem_post(&cache->lock);
+    }
+    fflush(out);
+}
+
+// The answer to a STATSREQ: the stats, and what the session has done so
+// far. Returns text to free, or NULL.
+char *stats_text(int client_id, struct session_metrics *m) {
+    char *text;
+    size_t len;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        perror("open_memstream failed");
+        return NULL;
+    }
+    show_stats(out);
+    print_session(out, client_id, m);
+    fclose(out);
+    return text;
+}
 
 
 void deserialize_connection_request(const char *inStr, struct connection_request *req) {
-    sscanf(inStr, "%d,%63[^,],%63[^,],%d", &req->client_id, req->cs_pipe_name, req->sc_pipe_name, &req->wsize);
+    // clients that do not name a transport use the FIFOs
+    sscanf(inStr, "%d,%63[^,],%63[^,],%d,%d", &req->client_id, req->cs_pipe_name, req->sc_pipe_name, &req->wsize, &req->transport);
 }
 
+// Connect to the socket the client listens on.
+int connect_client(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-int main(int argc, char* argv[]) {
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect to client socket failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s /message_queue_name\n", argv[0]);
-        exit(EXIT_FAILURE);
+
+// Talk to one client until it closes its end of the cs pipe or socket.
+void serve_connection(struct connection_request *request) {
+    // the session waits for its own commands, and notices a client that
+    // went away by write failing instead of by being killed
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    // builtins sort and format dates like the commands do in this locale
+    setlocale(LC_COLLATE, "");
+    setlocale(LC_TIME, "");
+    printf("cs: %s\n",request->cs_pipe_name);
+    int packet = request->transport == TRANSPORT_SOCKET;
+    int cs_fd, sc_fd;
+    if (packet) {
+        cs_fd = sc_fd = connect_client(request->cs_pipe_name);
+        if (sc_fd == -1)
+            return;
+    } else {
+        // cs stays open: a client that writes its first command while it
+        // was closed would get SIGPIPE
+        cs_fd = open(request->cs_pipe_name, O_RDONLY | O_CLOEXEC);
+        if (cs_fd == -1) {
+            perror("open cs_pipe failed");
+            return;
+        }
+
+        sc_fd = open(request->sc_pipe_name, O_WRONLY | O_CLOEXEC);
+        if (sc_fd == -1) {
+            perror("open sc_pipe failed");
+            close(cs_fd);
+            return;
+        }
     }
-    char* mqname = argv[1];
 
-    mqd_t mq;
-    struct mq_attr mq_attr;
-    int n;
-    int bufferlen;
-    char* bufferp;
 
-    mq = mq_open(mqname, O_RDONLY | O_CREAT, 0666, NULL);
-    if (mq == (mqd_t)-1) {
-        perror("mq_open");
-        exit(EXIT_FAILURE);
+    char* msg = "Connection established";
+    if (send_message(sc_fd, CONREPLY, 0, msg, strlen(msg)) == -1) {
+        perror("write to sc_pipe failed");
+        if (cs_fd != sc_fd)
+            close(cs_fd);
+        close(sc_fd);
+        return;
     }
-    printf("mq created, mq id = %d\n", (int)mq);
 
-    mq_getattr(mq, &mq_attr);
-    printf("mq maximum msgsize = %ld\n", mq_attr.mq_msgsize);
+    uint8_t coded[HEADER_SIZE + BUFFER_SIZE];
+    static struct session_metrics this_session;
+    session_metrics = &this_session;
+    memset(session_metrics, 0, sizeof(struct session_metrics));
+    __sync_fetch_and_add(&metrics->sessions, 1);
+    __sync_fetch_and_add(&metrics->active_sessions, 1);
+    for (int i = 0; i < MAX_INFLIGHT; i++)
+        session_commands[i].out_fd = -1;
+    nsession_commands = 0;
 
-    uint8_t* receivedMessage; 
-    uint32_t receivedMessageSize; 
-    receivedMessageSize = mq_attr.mq_msgsize; 
-    receivedMessage = (uint8_t*)malloc(receivedMessageSize);
+    // A client may send more commands before the results of earlier ones
+    // have come back. Up to MAX_INFLIGHT pipelines run at a time, and the
+    // session polls their output along with cs, so that the results come
+    // back tagged with their id as they are written. cs is not read while
+    // the limit is reached.
+    struct pollfd fds[MAX_INFLIGHT + 1];
+    struct session_command *polled[MAX_INFLIGHT + 1];
+    int status = 0;
+    while (status == 0) {
+        // the commands that finished
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+        fflush(stdout);
+
+        int nfds = 0;
+        fds[nfds].fd = nsession_commands < MAX_INFLIGHT ? cs_fd : -1;
+        fds[nfds++].events = POLLIN;
+        for (int i = 0; i < MAX_INFLIGHT; i++) {
+            if (session_commands[i].out_fd == -1)
+                continue;
+            polled[nfds] = &session_commands[i];
+            fds[nfds].fd = session_commands[i].out_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll failed");
+            break;
+        }
+
+        for (int i = 1; i < nfds && status == 0; i++) {
+            if (fds[i].revents != 0)
+                status = command_output(polled[i], request, sc_fd);
+        }
+        if (status == -1 || fds[0].revents == 0)
+            continue;
+
+        ssize_t len = read_message(cs_fd, packet, coded, sizeof(coded) - 1);
+        if (len == -1)
+            break; // client is gone
+        uint16_t id = coded[5] | (coded[6] << 8);
+        if (coded[4] == STATSREQ) {
+            char *text = stats_text(request->client_id, session_metrics);
+            command_id = id;
+            status = send_result(sc_fd, request->wsize, text != NULL ? text : "");
+            free(text);
+            continue;
+        }
+        if (coded[4] != COMLINE) {
+            fprintf(stderr, "Unexpected message type %d from client %d\n", coded[4], request->client_id);
+            break;
+        }
+        coded[len] = '\0';
+        char *cmd = (char *)coded + HEADER_SIZE;
+        printf("\nserver child: COMLINE message received: id=%d, len=%zd, data=%s\n"
+               ,id,len - HEADER_SIZE,cmd);
+        status = start_line(request, id, cmd, sc_fd);
+    }
+
+    // commands still running get SIGPIPE if they write, and are reaped
+    // when the next session of the worker looks
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        if (session_commands[i].out_fd != -1)
+            end_command(&session_commands[i]);
+    }
+    if (cs_fd != sc_fd)
+        close(cs_fd);
+    close(sc_fd);
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+    __sync_fetch_and_sub(&metrics->active_sessions, 1);
+    print_session(stdout, request->client_id, session_metrics);
+}
+
+
+// Session workers are forked ahead of time and take connection requests
+// from the dispatch pipe, so that a client does not wait for a fork to be
+// connected. The pool grows up to max workers while all of them are busy
+// and shrinks back to min as they become idle again.
+#define MIN_WORKERS 4
+#define MAX_WORKERS 32
+
+struct worker_pool {
+    int min;
+    int max;
+    int workers; // alive, changed by the main process only
+    int idle;    // waiting on the dispatch pipe
+};
+
+struct worker_pool *pool;
+int dispatch_fd[2];
+
+void worker_loop() {
+    struct connection_request request;
+    close(dispatch_fd[1]);
 
     while (1) {
-        n = mq_receive(mq, receivedMessage, receivedMessageSize, NULL);
+        // requests are smaller than PIPE_BUF, so each read gets one whole
+        ssize_t n = read(dispatch_fd[0], &request, sizeof(request));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n != sizeof(request))
+            exit(0); // server is gone
+        __sync_fetch_and_sub(&pool->idle, 1);
+
+        printf("Worker %d: serving client pid=%d\n", (int)getpid(), request.client_id);
+        serve_connection(&request);
+        fflush(stdout);
+
+        if (__sync_add_and_fetch(&pool->idle, 1) > pool->min) {
+            __sync_fetch_and_sub(&pool->idle, 1);
+            exit(0);
+        }
+    }
+}
+
+int spawn_worker() {
+    __sync_fetch_and_add(&pool->idle, 1);
+    __sync_fetch_and_add(&pool->workers, 1);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        __sync_fetch_and_sub(&pool->idle, 1);
+        __sync_fetch_and_sub(&pool->workers, 1);
+        return -1;
+    }
+    if (pid == 0)
+        worker_loop();
+    return 0;
+}
+
+void reap_workers(int signum) {
+    int saved_errno = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        __sync_fetch_and_sub(&pool->workers, 1);
+    errno = saved_errno;
+}
+
+
+volatile sig_atomic_t print_stats = 0;
+
+void stats_handler(int signum) {
+    print_stats = 1;
+}
+
+// Take the connection request out of a CONREQUEST message of n bytes.
+void parse_request(uint8_t *message, int n, struct connection_request *request) {
+    printf("mq_receive success, message size = %d\n", n);
+    // the request is parsed where it was received
+    message[n] = '\0';
+    memset(request, 0, sizeof(*request));
+    deserialize_connection_request((char *)message + HEADER_SIZE, request);
+    if (request->wsize <= HEADER_SIZE)
+        request->wsize = BUFFER_SIZE;
+    if (request->wsize > MAX_WSIZE)
+        request->wsize = MAX_WSIZE;
+    printf("Server main: CONREQUEST message received: pid=%d, cs=%s sc=%s, wsize=%d, %s\n"
+            ,request->client_id,request->cs_pipe_name,request->sc_pipe_name,request->wsize
+            ,request->transport == TRANSPORT_SOCKET ? "socket" : "fifo");
+}
+
+
+// Event mode (-e): one process serves every session with epoll instead of
+// a process per session. The mq, the channels of the sessions and the
+// output pipes of their running commands are all in one epoll set, and
+// nothing in the loop blocks. A session whose client is slow to read keeps
+// the frame it could not send, and stops reading the output of its
+// commands until the client has taken it. An idle session is only its
+// struct session; the frame buffer is there while commands run. Commands
+// are always spawned, without the builtins or the result cache.
+#define EV_MQ 0
+#define EV_SESSION 1
+#define EV_COMMAND 2
+
+struct session;
+
+struct command {
+    int kind;               // EV_COMMAND
+    struct session *session;
+    uint16_t id;
+    int out_fd;             // read end of the output of its pipeline, -1 if free
+    int events;             // waited for in the epoll set
+    long start;             // us, when it was started; -1 for a STATSREQ
+};
+
+struct session {
+    int kind;               // EV_SESSION
+    struct connection_request request;
+    int cs_fd;              // -1 once closed
+    int sc_fd;              // the same as cs_fd for a socket
+    int packet;
+    int cs_events;
+    int sc_events;
+    int ncommands;
+    struct command commands[MAX_INFLIGHT];
+    uint8_t *frame;         // frame_size bytes while commands run
+    int frame_size;         // wsize, or less if no memory could be had
+    size_t frame_len;       // of the frame being sent
+    size_t frame_off;       // how much of it the client has taken
+    size_t in_len;
+    uint8_t in[HEADER_SIZE + BUFFER_SIZE]; // commands read but not started
+    uint8_t small_frame[HEADER_SIZE + 64];  // the frame if malloc fails
+    struct session_metrics metrics;
+    struct session *next_closed;
+};
+
+int epfd;
+int nsessions;
+int ncommands;
+struct session *closed; // freed once the events at hand are handled
+
+// Wait for events on fd, or for none. A descriptor is in the epoll set only
+// while something is waited for, since a hang up is reported even then.
+void set_events(int fd, void *ptr, int *current, int events) {
+    struct epoll_event ev;
+    if (*current == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    int op = events == 0 ? EPOLL_CTL_DEL : *current == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epfd, op, fd, &ev) == -1)
+        perror("epoll_ctl failed");
+    *current = events;
+}
+
+void free_frame(struct session *s) {
+    if (s->frame != s->small_frame)
+        free(s->frame);
+    s->frame = NULL;
+}
+
+void close_session(struct session *s) {
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        if (s->commands[i].out_fd != -1) {
+            // the commands get SIGPIPE if they still write
+            set_events(s->commands[i].out_fd, &s->commands[i], &s->commands[i].events, 0);
+            close(s->commands[i].out_fd);
+            ncommands--;
+            if (s->commands[i].start != -1)
+                __sync_fetch_and_sub(&metrics->running, 1);
+        }
+    }
+    set_events(s->cs_fd, s, &s->cs_events, 0);
+    close(s->cs_fd);
+    if (!s->packet) {
+        set_events(s->sc_fd, s, &s->sc_events, 0);
+        close(s->sc_fd);
+    }
+    free_frame(s);
+    s->cs_fd = -1;
+    s->next_closed = closed;
+    closed = s;
+    nsessions--;
+    __sync_fetch_and_sub(&metrics->active_sessions, 1);
+    print_session(stdout, s->request.client_id, &s->metrics);
+}
+
+// Write as much of the frame as the client takes. Returns -1 if it is gone.
+int session_flush(struct session *s) {
+    while (s->frame_off < s->frame_len) {
+        ssize_t n = write(s->sc_fd, s->frame + s->frame_off, s->frame_len - s->frame_off);
         if (n == -1) {
-            perror("mq_receive failed");
-            continue;  
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
         }
-        printf("mq_receive success, message size = %d\n", n);
+        s->frame_off += n;
+    }
+    return 0;
+}
+
+// Start cmd with its output going to a pipe in the epoll set. A command
+// line that cannot be run gets its error message as its output, and a
+// STATSREQ, with cmd NULL, the stats. Without memory for a whole frame the
+// output goes in small frames, and a command line is not run.
+void start_command(struct session *s, uint16_t id, char *cmd) {
+    char *args[MAX_STAGES][MAX_ARGS + 1];
+    pid_t pids[MAX_STAGES];
+    const char *error;
+    int outfd[2];
 
-   
-        uint8_t receivedType;
-        uint32_t receivedDataSize;
-        uint8_t receivedData[1024];
-        decode_message(receivedMessage, &receivedType, &receivedData, &receivedDataSize);
+    if (cmd != NULL)
+        printf("Client %d: COMLINE id=%d, data=%s\n", s->request.client_id, id, cmd);
+    if (pipe2(outfd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close_session(s);
+        return;
+    }
+    if (s->frame == NULL) {
+        s->frame = malloc(s->request.wsize);
+        s->frame_size = s->request.wsize;
+        if (s->frame == NULL) {
+            perror("malloc failed");
+            s->frame = s->small_frame;
+            s->frame_size = sizeof(s->small_frame);
+        }
+    }
+    long start = now_us();
+    if (cmd == NULL) {
+        // much less than a pipe takes
+        char *text = stats_text(s->request.client_id, &s->metrics);
+        if (text != NULL)
+            write(outfd[1], text, strlen(text));
+        free(text);
+    } else {
+        s->metrics.commands++;
+        __sync_fetch_and_add(&metrics->commands, 1);
+        int nstages = parse_pipeline(cmd, args, &error);
+        if (nstages > 0 && s->frame == s->small_frame) {
+            error = "Error: Out of memory.\n";
+            nstages = 0;
+        }
+        if (nstages > 0) {
+            __sync_fetch_and_add(&metrics->stages[nstages], 1);
+            spawn_pipeline(args, nstages, outfd[1], pids);
+        } else {
+            write(outfd[1], error, strlen(error));
+        }
+    }
+    close(outfd[1]);
+    fcntl(outfd[0], F_SETFL, O_NONBLOCK);
 
+    struct command *c = s->commands;
+    while (c->out_fd != -1)
+        c++;
+    c->id = id;
+    c->out_fd = outfd[0];
+    c->start = cmd != NULL ? start : -1;
+    s->ncommands++;
+    ncommands++;
+    if (cmd != NULL)
+        __sync_fetch_and_add(&metrics->running, 1);
+}
 
-        struct connection_request* request = malloc(sizeof(struct connection_request));
-        if (request == NULL) {
-            perror("Failed to allocate memory for request");
-            exit(EXIT_FAILURE);
+// Start the commands that were read, as far as the limit allows, and wait
+// for what the session and its commands can do next.
+void session_progress(struct session *s) {
+    int sending = s->frame_off < s->frame_len;
+    while (s->ncommands < MAX_INFLIGHT && s->in_len >= HEADER_SIZE) {
+        uint8_t type;
+        uint16_t id;
+        uint32_t size;
+        char cmd[BUFFER_SIZE];
+        decode_header(s->in, &type, &id, &size);
+        if ((type != COMLINE && type != STATSREQ) || size >= BUFFER_SIZE) {
+            fprintf(stderr, "Malformed command from client %d\n", s->request.client_id);
+            close_session(s);
+            return;
         }
-        deserialize_connection_request(receivedData,request);
-        printf("Server main: CONREQUEST message received: pid=%d, cs=%s sc=%s, wsize=not entered by user (1024) \n"
-                ,request->client_id,request->cs_pipe_name,request->sc_pipe_name);
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork failed");
-            continue;
+        if (s->in_len < HEADER_SIZE + size)
+            break;
+        memcpy(cmd, s->in + HEADER_SIZE, size);
+        cmd[size] = '\0';
+        s->in_len -= HEADER_SIZE + size;
+        memmove(s->in, s->in + HEADER_SIZE + size, s->in_len);
+        start_command(s, id, type == STATSREQ ? NULL : cmd);
+        if (s->cs_fd == -1)
+            return;
+    }
+    if (s->ncommands == 0 && !sending)
+        free_frame(s);
+
+    int cs = s->ncommands < MAX_INFLIGHT ? EPOLLIN : 0;
+    int sc = sending ? EPOLLOUT : 0;
+    if (s->packet) {
+        set_events(s->cs_fd, s, &s->cs_events, cs | sc);
+    } else {
+        set_events(s->cs_fd, s, &s->cs_events, cs);
+        set_events(s->sc_fd, s, &s->sc_events, sc);
+    }
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        struct command *c = &s->commands[i];
+        if (c->out_fd != -1)
+            set_events(c->out_fd, c, &c->events, sending ? 0 : EPOLLIN);
+    }
+}
+
+void session_event(struct session *s, int events) {
+    if ((events & EPOLLOUT) && session_flush(s) == -1) {
+        close_session(s);
+        return;
+    }
+    // a packet is only read into an empty buffer, as it has to be whole
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !(s->packet && s->in_len > 0)) {
+        ssize_t n = read(s->cs_fd, s->in + s->in_len, sizeof(s->in) - s->in_len);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR))
+            n = -2;
+        if (n == 0 || n == -1) {
+            close_session(s); // the client is gone
+            return;
         }
-        else if (pid == 0) {  
-            printf("cs: %s\n",request->cs_pipe_name);
-            int cs_fd = open(request->cs_pipe_name, O_RDONLY);
-            if (cs_fd == -1) {
-                perror("open cs_pipe failed");
-                exit(EXIT_FAILURE);
-            }
-            close(cs_fd);
+        if (n > 0)
+            s->in_len += n;
+
+        uint8_t type;
+        uint16_t id;
+        uint32_t size;
+        decode_header(s->in, &type, &id, &size);
+        if (n > 0 && s->packet && (n < HEADER_SIZE || (size_t)n != HEADER_SIZE + size)) {
+            fprintf(stderr, "Malformed command from client %d\n", s->request.client_id);
+            close_session(s);
+            return;
+        }
+    }
+    session_progress(s);
+}
+
+// Send what the command wrote next as a frame, or the empty frame that ends
+// its output.
+void command_event(struct command *c) {
+    struct session *s = c->session;
+    if (s->frame_off < s->frame_len)
+        return; // an earlier event of this round filled the frame
+    ssize_t n = read(c->out_fd, s->frame + HEADER_SIZE, s->frame_size - HEADER_SIZE);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        perror("read from command failed");
+        n = 0;
+    }
+    encode_header(s->frame, COMRESULT, c->id, n);
+    s->frame_len = HEADER_SIZE + n;
+    s->frame_off = 0;
+    s->metrics.bytes += n;
+    __sync_fetch_and_add(&metrics->bytes, n);
+    if (n == 0) {
+        set_events(c->out_fd, c, &c->events, 0);
+        close(c->out_fd);
+        c->out_fd = -1;
+        s->ncommands--;
+        ncommands--;
+        if (c->start != -1) {
+            __sync_fetch_and_sub(&metrics->running, 1);
+            long wall = now_us() - c->start;
+            record(&metrics->wall, wall);
+            s->metrics.wall += wall;
+        }
+    }
+    if (session_flush(s) == -1)
+        close_session(s);
+    else
+        session_progress(s);
+}
 
+// Open the session's channel without waiting for the client. The cs FIFO
+// opened for reading lets the client's open for writing through, and sc
+// opened for reading and writing does not wait for the client's open for
+// reading; a client that went away shows as the end of cs.
+void open_session(struct connection_request *request) {
+    struct session *s = calloc(1, sizeof(struct session));
+    if (s == NULL) {
+        perror("calloc failed");
+        return;
+    }
+    s->kind = EV_SESSION;
+    s->request = *request;
+    s->packet = request->transport == TRANSPORT_SOCKET;
+    for (int i = 0; i < MAX_INFLIGHT; i++) {
+        s->commands[i].kind = EV_COMMAND;
+        s->commands[i].session = s;
+        s->commands[i].out_fd = -1;
+    }
 
-            int sc_fd = open(request->sc_pipe_name, O_WRONLY);
-            if (sc_fd == -1) {
-                perror("open sc_pipe failed");
-                close(cs_fd);
-                exit(EXIT_FAILURE);
-            }
+    if (s->packet) {
+        s->cs_fd = s->sc_fd = connect_client(request->cs_pipe_name);
+    } else {
+        s->cs_fd = open(request->cs_pipe_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        s->sc_fd = open(request->sc_pipe_name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (s->cs_fd == -1 || s->sc_fd == -1) {
+        perror("open session failed");
+        if (s->cs_fd != -1)
+            close(s->cs_fd);
+        if (s->sc_fd != -1 && s->sc_fd != s->cs_fd)
+            close(s->sc_fd);
+        free(s);
+        return;
+    }
+    fcntl(s->sc_fd, F_SETFL, O_NONBLOCK);
 
+    char* msg = "Connection established";
+    nsessions++;
+    __sync_fetch_and_add(&metrics->sessions, 1);
+    __sync_fetch_and_add(&metrics->active_sessions, 1);
+    if (send_message(s->sc_fd, CONREPLY, 0, msg, strlen(msg)) == -1) {
+        perror("write to sc_pipe failed");
+        close_session(s);
+        return;
+    }
+    session_progress(s);
+}
 
-            char* msg = "Connection established";
-            uint8_t* finalMessage = NULL;
-            uint32_t messageSize = 0;
-            encode_message(CONREPLY,msg,strlen(msg), &finalMessage,&messageSize);
+void event_loop(mqd_t mq, uint8_t *receivedMessage, uint32_t receivedMessageSize) {
+    struct epoll_event events[64];
+    int mq_kind = EV_MQ;
+    struct rlimit rl;
 
-            if (write(sc_fd, finalMessage, messageSize) == -1) {
-                perror("write to sc_pipe failed");
+    // every session holds a descriptor or two
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {EPOLLIN, {.ptr = &mq_kind}};
+    if (epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, (int)mq, &ev) == -1) {
+        perror("epoll failed");
+        exit(EXIT_FAILURE);
+    }
+    printf("Event loop started\n");
 
-                close(sc_fd);
-                close(cs_fd);
-                exit(EXIT_FAILURE);
-            }
+    while (1) {
+        if (print_stats) {
+            print_stats = 0;
+            printf("Event loop: %d sessions, %d commands running\n", nsessions, ncommands);
+            show_stats(stdout);
+        }
+        fflush(stdout);
+        int n = epoll_wait(epfd, events, 64, 1000);
+        if (n == -1 && errno != EINTR)
+            perror("epoll_wait failed");
 
-            uint8_t coded[request->wsize];
-            uint8_t receivedType1 = 0;
-            uint32_t receivedDataSize1 = 0;
-            uint8_t receivedData1[1024];
-            memset(receivedData1, 0, sizeof(receivedData1));
-            cs_fd = open(request->cs_pipe_name, O_RDONLY);
-            if (cs_fd == -1) {
-                perror("open cs_pipe failed");
-                exit(EXIT_FAILURE);
-            }
-            while(1){
-                ssize_t len = read(cs_fd, coded, 1024);
-                printf("\nserver child: COMLINE message received: len=%zd, type=3, data=%s\n"
-                       ,len,coded);
+        for (int i = 0; i < n; i++) {
+            int kind = *(int *)events[i].data.ptr;
+            if (kind == EV_MQ) {
+                struct connection_request request;
+                int len = mq_receive(mq, (char *)receivedMessage, receivedMessageSize, NULL);
                 if (len == -1) {
-                    perror("read from cs_pipe failed");
-                }
-                else {
-                    coded[len] = '\0';
-                    char *output = NULL;
-                    output = childserver(request,coded);
-                    printf("command execution finished");
-                    write(sc_fd, output, strlen(output)+1);
+                    perror("mq_receive failed");
+                    continue;
                 }
+                parse_request(receivedMessage, len, &request);
+                open_session(&request);
+            } else if (kind == EV_SESSION) {
+                struct session *s = events[i].data.ptr;
+                if (s->cs_fd != -1)
+                    session_event(s, events[i].events);
+            } else {
+                struct command *c = events[i].data.ptr;
+                if (c->session->cs_fd != -1 && c->out_fd != -1)
+                    command_event(c);
             }
+        }
 
-            /*
+        while (closed != NULL) {
+            struct session *s = closed;
+            closed = s->next_closed;
+            free(s);
+        }
+        // the commands that finished
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+            ;
+    }
+}
 
 
+int main(int argc, char* argv[]) {
+    int ttl = 0;
+    int event_mode = 0;
+    int opt;
 
-            if (write(sc_fd, "ok We did it", sizeof(coded) == -1)) {
-                perror("read from cs_pipe failed");
-            }
+    while ((opt = getopt(argc, argv, "c:e")) != -1) {
+        if (opt == 'c')
+            ttl = atoi(optarg);
+        else if (opt == 'e')
+            event_mode = 1;
+        else
+            argc = 0; // show the usage
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 1 && argc != 3) {
+        fprintf(stderr, "Usage: comserver [-c ttl] [-e] /message_queue_name [min_workers max_workers]\n");
+        fprintf(stderr, "       -c keeps the output of read-only commands for ttl seconds\n");
+        fprintf(stderr, "       -e serves all sessions from one process with epoll\n");
+        fprintf(stderr, "       max_workers 0 forks a process for each connection instead\n");
+        exit(EXIT_FAILURE);
+    }
+    char* mqname = argv[0];
 
-             */
+    mqd_t mq;
+    struct mq_attr mq_attr;
+    int n;
 
-            free(request);
-            close(cs_fd);
-            close(sc_fd);
-            exit(0); 
+    pool = mmap(NULL, sizeof(struct worker_pool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    pool->min = MIN_WORKERS;
+    pool->max = MAX_WORKERS;
+    if (argc == 3) {
+        pool->min = atoi(argv[1]);
+        pool->max = atoi(argv[2]);
+        if (pool->min < 0 || (pool->max > 0 && pool->max < pool->min)) {
+            fprintf(stderr, "min_workers must be between 0 and max_workers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    metrics = mmap(NULL, sizeof(struct server_metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ttl > 0) {
+        cache = mmap(NULL, sizeof(struct result_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (cache == MAP_FAILED) {
+            perror("mmap failed");
+            exit(EXIT_FAILURE);
+        }
+        sem_init(&cache->lock, 1, 1);
+        cache->ttl = ttl;
+        printf("Result cache on, ttl=%d s\n", ttl);
+    }
+
+    mq = mq_open(mqname, O_RDONLY | O_CREAT, 0666, NULL);
+    if (mq == (mqd_t)-1) {
+        perror("mq_open");
+        exit(EXIT_FAILURE);
+    }
+    printf("mq created, mq id = %d\n", (int)mq);
+
+    mq_getattr(mq, &mq_attr);
+    printf("mq maximum msgsize = %ld\n", mq_attr.mq_msgsize);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = event_mode ? SIG_DFL : pool->max > 0 ? reap_workers : SIG_IGN;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // SIGUSR1 prints the stats; it interrupts mq_receive to do so
+    sa.sa_handler = stats_handler;
+    sa.sa_flags = 0;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    uint8_t* receivedMessage; 
+    uint32_t receivedMessageSize; 
+    receivedMessageSize = mq_attr.mq_msgsize; 
+    receivedMessage = (uint8_t*)malloc(receivedMessageSize + 1);
+
+    if (event_mode)
+        event_loop(mq, receivedMessage, receivedMessageSize);
+
+    if (pool->max > 0) {
+        if (pipe(dispatch_fd) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < pool->min; i++)
+            spawn_worker();
+        printf("Worker pool started: min=%d max=%d\n", pool->min, pool->max);
+    }
+
+    while (1) {
+        if (print_stats) {
+            print_stats = 0;
+            show_stats(stdout);
+        }
+        n = mq_receive(mq, (char *)receivedMessage, receivedMessageSize, NULL);
+        if (n == -1) {
+            if (errno != EINTR)
+                perror("mq_receive failed");
+            continue;  
+        }
+        struct connection_request request;
+        parse_request(receivedMessage, n, &request);
+
+        if (pool->max == 0) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork failed");
+            } else if (pid == 0) {
+                serve_connection(&request);
+                exit(0);
+            }
+            continue;
         }
 
+        // hand the connection to an idle worker, adding one if none is
+        if (pool->idle == 0 && pool->workers < pool->max)
+            spawn_worker();
+        if (write(dispatch_fd[1], &request, sizeof(request)) != sizeof(request))
+            perror("write to dispatch pipe failed");
     }
 
-    free(bufferp);
+    free(receivedMessage);
     mq_close(mq);
     mq_unlink(mqname);
     return 0;
@@ -0,0 +1,120 @@
+// Connection benchmark: nclients processes connect to comserver at the same
+// time, rounds times each, and the time from sending CONREQUEST to reading
+// CONREPLY is reported. Run it against "comserver /mq 0 0" (a fork for
+// each connection) and against the worker pool to compare.
+//
+// usage: ./conbench /message_queue_name nclients rounds
+
+#include <stdlib.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "comcodec.h"
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// One connect and disconnect. Returns the connect latency in us, or -1.
+double connect_once(mqd_t mq, int round) {
+    char cs[64], sc[64], req[1024];
+    uint8_t msg[HEADER_SIZE + sizeof(req)];
+
+    sprintf(cs, "/tmp/cb_cs_%d_%d", getpid(), round);
+    sprintf(sc, "/tmp/cb_sc_%d_%d", getpid(), round);
+    if (mkfifo(cs, 0666) == -1 || mkfifo(sc, 0666) == -1) {
+        perror("mkfifo");
+        return -1;
+    }
+    int len = sprintf(req, "%d,%s,%s,%d,%d", getpid(), cs, sc, 1024, TRANSPORT_FIFO) + 1;
+    uint32_t size = HEADER_SIZE + len;
+    encode_header(msg, CONREQUEST, 0, len);
+    memcpy(msg + HEADER_SIZE, req, len);
+
+    double start = now_us();
+    double latency = -1;
+    if (mq_send(mq, (char *)msg, size, 0) == -1) {
+        perror("mq_send failed");
+    } else {
+        int cs_fd = open(cs, O_WRONLY);
+        int sc_fd = open(sc, O_RDONLY);
+        uint8_t reply[1024];
+        if (cs_fd != -1 && sc_fd != -1 && read_message(sc_fd, 0, reply, sizeof(reply)) != -1)
+            latency = now_us() - start;
+        if (cs_fd != -1)
+            close(cs_fd);
+        if (sc_fd != -1)
+            close(sc_fd);
+    }
+    unlink(cs);
+    unlink(sc);
+    return latency;
+}
+
+int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s /message_queue_name nclients rounds\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int nclients = atoi(argv[2]);
+    int rounds = atoi(argv[3]);
+    int total = nclients * rounds;
+
+    double *lat = mmap(NULL, total * sizeof(double), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lat == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_us();
+    for (int c = 0; c < nclients; c++) {
+        if (fork() == 0) {
+            mqd_t mq = mq_open(argv[1], O_WRONLY);
+            if (mq == (mqd_t)-1) {
+                perror("mq_open");
+                exit(EXIT_FAILURE);
+            }
+            for (int r = 0; r < rounds; r++)
+                lat[c * rounds + r] = connect_once(mq, r);
+            mq_close(mq);
+            exit(0);
+        }
+    }
+    while (wait(NULL) > 0)
+        ;
+    double elapsed = now_us() - start;
+
+    int ok = 0;
+    double sum = 0;
+    for (int i = 0; i < total; i++) {
+        if (lat[i] >= 0) {
+            lat[ok++] = lat[i];
+            sum += lat[i];
+        }
+    }
+    if (ok == 0) {
+        fprintf(stderr, "No connection succeeded\n");
+        exit(EXIT_FAILURE);
+    }
+    qsort(lat, ok, sizeof(double), compare);
+    printf("%d/%d connections in %.1f ms, %.0f connections/s\n", ok, total, elapsed / 1000, ok / (elapsed / 1e6));
+    printf("connect latency us: avg %.0f  p50 %.0f  p99 %.0f  max %.0f\n",
+           sum / ok, lat[ok / 2], lat[ok * 99 / 100], lat[ok - 1]);
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Launch microbenchmark: start a trivial command n times with fork+execvp,
+// the way comserver used to, and with posix_spawnp, the way it does now,
+// and report commands per second. heap_mb of touched heap stands in for
+// what a long running session has allocated, which fork has to copy the
+// page tables of.
+//
+// usage: ./spawnbench n [heap_mb] [command]
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+pid_t launch_fork(char **argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+pid_t launch_spawn(char **argv) {
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+        return -1;
+    return pid;
+}
+
+double run(pid_t (*launch)(char **), char **argv, int n) {
+    double start = now_s();
+    for (int i = 0; i < n; i++) {
+        pid_t pid = launch(argv);
+        if (pid == -1) {
+            perror("launch");
+            exit(EXIT_FAILURE);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return n / (now_s() - start);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s n [heap_mb] [command]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int n = atoi(argv[1]);
+    long heap_mb = argc > 2 ? atol(argv[2]) : 0;
+    char *cmd[] = {argc > 3 ? argv[3] : "true", NULL};
+
+    if (heap_mb > 0) {
+        char *heap = malloc(heap_mb << 20);
+        if (heap == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memset(heap, 1, heap_mb << 20);
+    }
+
+    printf("%s x %d, %ld MB heap\n", cmd[0], n, heap_mb);
+    printf("fork+execvp:  %8.0f commands/s\n", run(launch_fork, cmd, n));
+    printf("posix_spawnp: %8.0f commands/s\n", run(launch_spawn, cmd, n));
+    return 0;
+}
@@ -0,0 +1,230 @@
+// Transport benchmark: FIFO pair against SOCK_SEQPACKET unix socket, for
+// the round trip of a small command and for bulk output. It first measures
+// the bare channels between two processes, the way a session and its client
+// use them, and then, given a comserver queue, whole commands through the
+// server: rounds of "echo x", and "cat file" for throughput.
+//
+// usage: ./transbench rounds [/message_queue_name file]
+
+#include <stdlib.h>
+#include <mqueue.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "comcodec.h"
+
+#define WSIZE 65536
+#define BULK_MB 256
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void report(const char *what, double *lat, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += lat[i];
+    qsort(lat, n, sizeof(double), compare);
+    printf("%-28s avg %7.1f  p50 %7.1f  p99 %7.1f us\n", what, sum / n, lat[n / 2], lat[n * 99 / 100]);
+}
+
+// Read one frame the way the transport delivers it. Returns its data size.
+int read_frame(int fd, int packet, uint8_t *frame) {
+    ssize_t n = read_message(fd, packet, frame, WSIZE);
+    return n == -1 ? -1 : (int)(n - HEADER_SIZE);
+}
+
+// The bare channel: a child answers each small frame with one of its own,
+// or with BULK_MB of full frames when asked for bulk.
+void channel(const char *name, int packet, int to_child[2], int to_parent[2], int rounds) {
+    static uint8_t frame[WSIZE];
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(to_child[1]);
+        close(to_parent[0]);
+        int n;
+        while ((n = read_frame(to_child[0], packet, frame)) >= 0) {
+            if (n == 0) {
+                send_message(to_parent[1], COMRESULT, 0, frame + HEADER_SIZE, 8);
+                continue;
+            }
+            encode_header(frame, COMRESULT, 0, WSIZE - HEADER_SIZE);
+            for (long sent = 0; sent < (long)BULK_MB << 20; sent += WSIZE - HEADER_SIZE)
+                write(to_parent[1], frame, WSIZE);
+            send_message(to_parent[1], COMRESULT, 0, NULL, 0);
+        }
+        _exit(0);
+    }
+    close(to_child[0]);
+    close(to_parent[1]);
+
+    double *lat = malloc(rounds * sizeof(double));
+    for (int i = 0; i < rounds; i++) {
+        double start = now_us();
+        send_message(to_child[1], COMLINE, 0, NULL, 0);
+        read_frame(to_parent[0], packet, frame);
+        lat[i] = now_us() - start;
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "%s round trip:", name);
+    report(what, lat, rounds);
+    free(lat);
+
+    double start = now_us();
+    send_message(to_child[1], COMLINE, 0, "b", 1);
+    long bytes = 0;
+    int n;
+    while ((n = read_frame(to_parent[0], packet, frame)) > 0)
+        bytes += n;
+    printf("%-28s %.0f MB/s\n", (snprintf(what, sizeof(what), "%s bulk:", name), what),
+           bytes / (now_us() - start));
+
+    close(to_child[1]);
+    close(to_parent[0]);
+    waitpid(pid, NULL, 0);
+}
+
+char cs[64], sc[64];
+
+// Connect to comserver over the given transport, as comcli does.
+int connect_server(const char *mqname, int packet, int *cs_fd, int *sc_fd) {
+    char req[256];
+    uint8_t msg[HEADER_SIZE + sizeof(req)];
+    int listen_fd = -1;
+
+    sprintf(cs, "/tmp/tb_cs_%d", getpid());
+    sprintf(sc, "/tmp/tb_sc_%d", getpid());
+    if (packet) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, cs);
+        strcpy(sc, cs);
+        unlink(cs);
+        listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 1) == -1) {
+            perror("socket");
+            return -1;
+        }
+    } else if (mkfifo(cs, 0666) == -1 || mkfifo(sc, 0666) == -1) {
+        perror("mkfifo");
+        return -1;
+    }
+
+    mqd_t mq = mq_open(mqname, O_WRONLY);
+    if (mq == (mqd_t)-1) {
+        perror("mq_open");
+        return -1;
+    }
+    int len = sprintf(req, "%d,%s,%s,%d,%d", getpid(), cs, sc, WSIZE,
+                      packet ? TRANSPORT_SOCKET : TRANSPORT_FIFO) + 1;
+    encode_header(msg, CONREQUEST, 0, len);
+    memcpy(msg + HEADER_SIZE, req, len);
+    if (mq_send(mq, (char *)msg, HEADER_SIZE + len, 0) == -1) {
+        perror("mq_send failed");
+        return -1;
+    }
+    mq_close(mq);
+
+    if (packet) {
+        *cs_fd = *sc_fd = accept(listen_fd, NULL, NULL);
+        close(listen_fd);
+        unlink(cs);
+    } else {
+        *cs_fd = open(cs, O_WRONLY);
+        *sc_fd = open(sc, O_RDONLY);
+    }
+    if (*cs_fd == -1 || *sc_fd == -1 || read_message(*sc_fd, packet, msg, sizeof(msg)) == -1) {
+        fprintf(stderr, "Could not connect to the server\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Run cmd and return how many bytes of output came back.
+long command(int cs_fd, int sc_fd, int packet, const char *cmd) {
+    static uint8_t frame[WSIZE];
+    if (send_message(cs_fd, COMLINE, 0, cmd, strlen(cmd)) == -1)
+        return -1;
+    long bytes = 0;
+    int n;
+    while ((n = read_frame(sc_fd, packet, frame)) > 0)
+        bytes += n;
+    return n == 0 ? bytes : -1;
+}
+
+void server(const char *name, const char *mqname, int packet, const char *file, int rounds) {
+    int cs_fd, sc_fd;
+    char what[64], cmd[256];
+    if (connect_server(mqname, packet, &cs_fd, &sc_fd) == -1)
+        return;
+
+    double *lat = malloc(rounds * sizeof(double));
+    for (int i = 0; i < rounds; i++) {
+        double start = now_us();
+        command(cs_fd, sc_fd, packet, "echo x");
+        lat[i] = now_us() - start;
+    }
+    snprintf(what, sizeof(what), "%s echo x:", name);
+    report(what, lat, rounds);
+    free(lat);
+
+    snprintf(cmd, sizeof(cmd), "cat %s", file);
+    long bytes = 0;
+    double start = now_us();
+    for (int i = 0; i < 10; i++)
+        bytes += command(cs_fd, sc_fd, packet, cmd);
+    snprintf(what, sizeof(what), "%s cat:", name);
+    printf("%-28s %.0f MB/s\n", what, bytes / (now_us() - start));
+
+    if (cs_fd != sc_fd)
+        close(cs_fd);
+    close(sc_fd);
+    unlink(cs);
+    unlink(sc);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 4) {
+        fprintf(stderr, "Usage: %s rounds [/message_queue_name file]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    int rounds = atoi(argv[1]);
+    int to_child[2], to_parent[2];
+
+    if (pipe(to_child) == -1 || pipe(to_parent) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    channel("fifo", 0, to_child, to_parent, rounds);
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, to_child) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    // one socket carries both directions, as with a session
+    to_parent[0] = dup(to_child[1]);
+    to_parent[1] = dup(to_child[0]);
+    channel("socket", 1, to_child, to_parent, rounds);
+
+    if (argc == 4) {
+        server("comserver fifo", argv[2], 0, argv[3], rounds);
+        server("comserver socket", argv[2], 1, argv[3], rounds);
+    }
+    return 0;
+}
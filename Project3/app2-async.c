@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "mf.h"
+
+// The producer and consumer of app2, once with mf_send/mf_recv and once
+// with the submission/completion ring, keeping DEPTH requests in flight.
+
+#define COUNT 10
+#define DEPTH 32
+
+int totalcount = COUNT;
+
+double test_messageflow_2p1mq(int async);
+void producer_sync(int qid);
+void consumer_sync(int qid);
+void producer_async(int qid);
+void consumer_async(int qid);
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc != 2) {
+        printf ("usage: app2-async numberOfMessages\n");
+        exit(1);
+    }
+    totalcount = atoi(argv[1]);
+
+    srand(time(0));
+
+    double sync_secs = test_messageflow_2p1mq(0);
+    double async_secs = test_messageflow_2p1mq(1);
+
+    printf("mf_send/mf_recv: %d messages in %.3f s, %.0f msgs/s\n",
+           totalcount, sync_secs, totalcount / sync_secs);
+    printf("mf_ring (depth %d): %d messages in %.3f s, %.0f msgs/s\n",
+           DEPTH, totalcount, async_secs, totalcount / async_secs);
+	return 0;
+}
+
+
+double test_messageflow_2p1mq(int async)
+{
+    int ret1, qid;
+    int i;
+    struct timespec start, end;
+
+    mf_connect();
+    mf_create ("mq1", 16); //  create mq;  size in KB
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    ret1 = fork();
+    if (ret1 ==  0) {
+        //  process - P1
+        mf_connect();
+        qid = mf_open("mq1");
+        if (async)
+            producer_async(qid);
+        else
+            producer_sync(qid);
+        mf_close(qid);
+        mf_disconnect();
+        exit(0);
+    }
+    ret1  = fork();
+    if (ret1 == 0) {
+        //  process - P2
+        mf_connect();
+        qid = mf_open("mq1");
+        if (async)
+            consumer_async(qid);
+        else
+            consumer_sync(qid);
+        mf_close(qid);
+        mf_disconnect();
+        exit(0);
+    }
+
+    for (i = 0; i < 2; ++i)
+        wait(NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mf_remove("mq1");
+    mf_disconnect();
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+void producer_sync(int qid)
+{
+    char sendbuffer[MAX_DATALEN];
+    int sentcount;
+
+    for (sentcount = 0; sentcount < totalcount; sentcount++)
+        mf_send(qid, (void *) sendbuffer, rand() % MAX_DATALEN);
+}
+
+void consumer_sync(int qid)
+{
+    char recvbuffer[MAX_DATALEN];
+    int receivedcount;
+
+    for (receivedcount = 0; receivedcount < totalcount; receivedcount++)
+        mf_recv(qid, (void *) recvbuffer, MAX_DATALEN);
+}
+
+
+// Keep the ring full of sends; the data is only read, so they can all
+// point to the same buffer.
+void producer_async(int qid)
+{
+    static char sendbuffer[MAX_DATALEN];
+    mf_ring_t *ring = mf_ring_create(DEPTH);
+    mf_sqe_t sqe;
+    mf_cqe_t cqes[DEPTH];
+    int submitted = 0, completed = 0;
+
+    while (completed < totalcount) {
+        while (submitted < totalcount) {
+            sqe.op = MF_OP_SEND;
+            sqe.qid = qid;
+            sqe.buf = sendbuffer;
+            sqe.len = rand() % MAX_DATALEN;
+            sqe.user_data = submitted;
+            if (mf_ring_submit(ring, &sqe, 1) == 0)
+                break;
+            submitted++;
+        }
+        int n = mf_ring_complete(ring, cqes, DEPTH, 1);
+        for (int i = 0; i < n; i++) {
+            if (cqes[i].res < 0)
+                fprintf(stderr, "send %lu failed\n", cqes[i].user_data);
+        }
+        completed += n;
+    }
+    mf_ring_destroy(ring);
+}
+
+// Keep DEPTH receives in flight, each with a buffer of its own that is
+// handed out again when its receive completes.
+void consumer_async(int qid)
+{
+    static char recvbuffers[DEPTH][MAX_DATALEN];
+    mf_ring_t *ring = mf_ring_create(DEPTH);
+    mf_sqe_t sqe;
+    mf_cqe_t cqes[DEPTH];
+    int submitted = 0, completed = 0;
+
+    for (int slot = 0; slot < DEPTH && submitted < totalcount; slot++, submitted++) {
+        sqe.op = MF_OP_RECV;
+        sqe.qid = qid;
+        sqe.buf = recvbuffers[slot];
+        sqe.len = MAX_DATALEN;
+        sqe.user_data = slot;
+        mf_ring_submit(ring, &sqe, 1);
+    }
+    while (completed < totalcount) {
+        int n = mf_ring_complete(ring, cqes, DEPTH, 1);
+        for (int i = 0; i < n; i++) {
+            if (cqes[i].res < 0)
+                fprintf(stderr, "receive failed\n");
+            if (submitted < totalcount) {
+                sqe.buf = recvbuffers[cqes[i].user_data];
+                sqe.user_data = cqes[i].user_data;
+                mf_ring_submit(ring, &sqe, 1);
+                submitted++;
+            }
+        }
+        completed += n;
+    }
+    mf_ring_destroy(ring);
+}
@@ -0,0 +1,106 @@
+// Throughput of mf::channel<T> against the raw C API for the same message.
+// Run mfserver first.
+//
+// usage: ./bench_channel numberOfMessages
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mf.hpp"
+
+struct Sample {
+    long seq;
+    double value;
+    int sensor;
+    char label[44];
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The hand written wrapper this replaces: fill a local struct, let mf_send
+// copy it in, and copy it out again with mf_recv plus a size check.
+static double bench_raw(long count) {
+    mf_create((char *)"bench_raw", 64);
+    double start = now();
+    if (fork() == 0) {
+        mf_connect();
+        int qid = mf_open((char *)"bench_raw");
+        Sample s;
+        for (long i = 0; i < count; i++) {
+            memset(&s, 0, sizeof(s));
+            s.seq = i;
+            s.value = i * 0.5;
+            s.sensor = 7;
+            mf_send(qid, &s, sizeof(s));
+        }
+        mf_close(qid);
+        mf_disconnect();
+        exit(0);
+    }
+    int qid = mf_open((char *)"bench_raw");
+    char buf[MAX_DATALEN];
+    long sum = 0;
+    for (long i = 0; i < count; i++) {
+        int n = mf_recv(qid, buf, sizeof(buf));
+        if (n != sizeof(Sample)) {
+            fprintf(stderr, "unexpected message size %d\n", n);
+            exit(1);
+        }
+        Sample s;
+        memcpy(&s, buf, sizeof(s));
+        sum += s.seq;
+    }
+    wait(NULL);
+    double elapsed = now() - start;
+    mf_close(qid);
+    mf_remove((char *)"bench_raw");
+    return elapsed;
+}
+
+static double bench_channel(long count) {
+    mf_create((char *)"bench_channel", 64);
+    double start = now();
+    if (fork() == 0) {
+        {
+            mf::connection conn;
+            mf::channel<Sample> ch("bench_channel");
+            for (long i = 0; i < count; i++)
+                ch.send(i, i * 0.5, 7);
+        }
+        exit(0);
+    }
+    long sum = 0;
+    {
+        mf::channel<Sample> ch("bench_channel");
+        for (long i = 0; i < count; i++)
+            ch.recv([&sum](const Sample &s) { sum += s.seq; });
+        wait(NULL);
+    }
+    double elapsed = now() - start;
+    mf_remove((char *)"bench_channel");
+    return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("usage: ./bench_channel numberOfMessages\n");
+        exit(1);
+    }
+    long count = atol(argv[1]);
+
+    mf::connection conn;
+    double raw = bench_raw(count);
+    double typed = bench_channel(count);
+
+    printf("message size: %zu bytes, messages: %ld\n", sizeof(Sample), count);
+    printf("raw C API:   %.3f s  %.0f msgs/s\n", raw, count / raw);
+    printf("mf::channel: %.3f s  %.0f msgs/s\n", typed, count / typed);
+    return 0;
+}
@@ -1,60 +1,225 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <time.h>
 #include <math.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <signal.h>
 #include "mf.h"
+#include "mftrace.h"
 
 #define MF_ERROR -1
 #define MF_SUCCESS 0
-#define BLOCK_SIZE 1
+#define MF_EMPTY -2
+#define MF_FULL -3
+
+#define MF_MAGIC 0x4d465348 // "MFSH"
+#define MAX_QUEUES 64
+// hard limit on MAX_QUEUES_IN_SHMEM, size of the queue directory
+
+#define MAX_CLIENTS 64
+// processes that can be connected at the same time
+
+#define MAX_SHARDED 8
+#define MAX_SHARDS 16
+#define MAX_MEMBERS 16
+// sharded queues, physical queues per sharded queue, consumers per group
+
+#define BLOCK_SIZE 1024
+// allocation unit of the shared memory bitmap, in bytes
+
+#define DURABLE_MAGIC 0x4d464451 // "MFDQ"
+#define DURABLE_FILE_FMT "%s/mf_%s.mq"
+// durable directory, queue name
+
+#define WRAP_MARKER -1
+// datalength of a record that tells the reader to continue at offset 0
+
+#define TAKEN_FLAG 0x40000000
+#define MSG_LEN(msg) ((msg)->datalength & ~TAKEN_FLAG)
+// set in datalength of a message that mf_recv_match took out of the middle
+// of the ring; its space is given back once it reaches the head
+
+#define MAX_RINGS 32
+// mf_ring_t helpers per segment; bit r of a queue's ring_watch is ring r
+
+#define MAX_FILTERS 8
+// mf_recv_match callers per queue that are only woken by matching messages
+
+#define MSG_ALIGN 8
+#define ROUNDUP(x) (((x) + MSG_ALIGN - 1) & ~(MSG_ALIGN - 1))
+// records in the ring start and end on MSG_ALIGN boundaries so that the
+// data of a message can hold any type in place
 
 typedef struct {
     char shmem_name[256];
     int shmem_size;
     int max_msgs_in_queue;
     int max_queues_in_shmem;
+    int trace_events; // size of the per process trace ring, 0 disables tracing
+    char trace_dir[256];
+    char durable_dir[256];
+    int commit_interval_us; // how long a durable send waits for others to share its flush
+    int commit_batch;       // flush as soon as this many sends are waiting
 } Config;
 
+// A message as it is stored in the ring of a queue.
 typedef struct message {
     int datalength;
-    void* bufptr;
-    void* head;
-    void* tail;
+    unsigned int tag;
+    char data[] __attribute__((aligned(MSG_ALIGN)));
 } message_t;
 
-typedef struct QueueNode {
-    message_t* data;
-    struct QueueNode* next;
-} QueueNode;
+// A receiver in mf_recv_match sleeping until a message with
+// (tag & mask) == value is sent.
+typedef struct {
+    int used;
+    unsigned int mask;
+    unsigned int value;
+    sem_t wait;
+    int waiters;
+} recv_filter_t;
+
+typedef struct {
+    int used;
+    int offset;  // offset of the message_queue_t from the start of the segment
+    int durable; // the queue is in its own file instead, see map_durable
+    int gen;     // changes each time the slot is reused
+    int pins;    // calls using the queue right now, -1 while compact moves it
+    char name[MAX_MQNAMESIZE];
+} queue_entry_t;
+
+// A connected process and the references and pins it holds on each queue,
+// so that they can be given back when it dies without closing them, or
+// while it sleeps in a call.
+typedef struct {
+    int pid;
+    unsigned short opens[MAX_QUEUES];
+    unsigned short pins[MAX_QUEUES];
+} client_t;
+
+typedef struct {
+    unsigned int id;
+    int pid;
+} member_t;
+
+// The helper thread of an mf_ring_t sleeps on wake when none of its
+// requests can go on, after it put its bit in the ring_watch of each queue
+// they wait for.
+typedef struct {
+    int pid; // 0 if the slot is free
+    sem_t wake;
+} ring_slot_t;
 
+// A logical queue spread over nshards physical queues named <name>#<i>.
+// Its consumer group owns the shards between them: the member at position
+// p in members receives from the shards s with s % nmembers == p.
 typedef struct {
-    QueueNode* front;
-    QueueNode* rear;
-} Queue;
+    int used;
+    int nshards;
+    int shards[MAX_SHARDS];       // qids of the physical queues
+    unsigned int rr;              // round robin cursor of senders
+    sem_t lock;                   // protects the group
+    member_t members[MAX_MEMBERS];
+    int nmembers;
+    unsigned int member_seq;
+    unsigned int generation;      // changes whenever the group changes
+    sem_t member_wait[MAX_MEMBERS]; // member at position p sleeps on member_wait[p]
+    int waiting[MAX_MEMBERS];
+    long rebalances;
+    char name[MAX_MQNAMESIZE];
+} sharded_t;
+
+// Lives at offset 0 of the shared memory segment. Everything in the segment
+// is addressed by offsets since each process maps it at a different address.
+typedef struct {
+    int magic;
+    int shmem_size;
+    int max_msgs_in_queue;
+    int max_queues_in_shmem;
+    int nblocks;
+    int commit_interval_us;
+    int commit_batch;
+    int queue_gen;
+    sem_t lock; // protects the queue directory, the clients and the bitmap
+    pid_t lock_owner; // process holding lock, 0 when free
+    queue_entry_t queues[MAX_QUEUES];
+    client_t clients[MAX_CLIENTS];
+    sharded_t sharded[MAX_SHARDED];
+    ring_slot_t rings[MAX_RINGS];
+    mf_server_stats_t stats;
+    unsigned char bitmap[];
+} shm_header_t;
 
 typedef struct {
     sem_t mutex;
-    void* head;
-    void* tail;
-    void* base_ptr;
-    int capacity;
+    sem_t recv_wait; // receivers sleep here while the queue is empty
+    sem_t send_wait; // senders sleep here while the queue is full
+    int recv_waiters;
+    int send_waiters;
+    int head;     // offset in data of the oldest message
+    int tail;     // offset in data where the next message goes
+    int used;     // bytes of data in use, including wrap padding
+    int count;    // messages in the queue
+    int taken;    // messages taken by mf_recv_match but still in the ring
+    int capacity; // size of data in bytes
+    int size;     // size of the whole queue including this header
     int refcount;
-    char* name;
-    Queue* waitlist;
-    char data[];
+    int durable;  // DURABLE_MAGIC if the queue is backed by a file
+    unsigned long send_seq;   // durable queues: messages sent so far
+    unsigned long commit_seq; // messages sent so far that are flushed to the file
+    int committing;           // a sender is flushing the current batch
+    unsigned long failed_seq; // first message whose flush failed, 0 if none
+    sem_t commit_wait;        // senders wait here until their message is flushed
+    int commit_waiters;
+    sem_t batch_wait;         // the flushing sender waits here for the batch to fill
+    long commits;
+    int high_wm;              // used bytes at which producers are out of credit
+    int low_wm;               // used bytes at which they get credit again
+    int above_high;           // crossed high_wm and did not drain to low_wm yet
+    unsigned int wm_seq;      // number of watermark crossings so far
+    sem_t wm_wait;            // producers waiting for a crossing
+    int wm_waiters;
+    long sends;
+    long recvs;
+    long send_blocks;         // sends that had to wait for space
+    long recv_blocks;         // receives that had to wait for a message
+    long high_crossings;
+    long low_crossings;
+    unsigned int ring_watch;  // rings whose helper waits for the queue to change
+    recv_filter_t filters[MAX_FILTERS];
+    char name[MAX_MQNAMESIZE];
+    char data[] __attribute__((aligned(MSG_ALIGN)));
 } message_queue_t;
 
-typedef struct free_block {
-    size_t size;
-    struct free_block* next;
-} free_block_t;
+// Header put in front of the payload of request and reply messages.
+typedef struct {
+    unsigned int corr_id;
+    int reply_qid;
+    int datalen;
+} rpc_header_t;
+
+#define MAX_CALL_DATALEN (MAX_DATALEN - (int)sizeof(rpc_header_t))
+
+// A caller waiting in mf_call for its reply.
+typedef struct pending_call {
+    unsigned int corr_id;
+    int reply_qid;
+    void *repbuf;
+    int repsize;
+    int replen;
+    int done;
+    struct pending_call *next;
+} pending_call_t;
 
-unsigned char *bitmap;
 int read_config(Config *config) {
     FILE *file = fopen(CONFIG_FILENAME, "r");
     if (!file) {
@@ -62,6 +227,15 @@ int read_config(Config *config) {
         return MF_ERROR;
     }
 
+    config->shmem_size = MIN_SHMEMSIZE * 1024;
+    config->max_msgs_in_queue = 10;
+    config->max_queues_in_shmem = 10;
+    config->trace_events = 0;
+    strcpy(config->trace_dir, "/tmp");
+    strcpy(config->durable_dir, "/tmp");
+    config->commit_interval_us = 2000;
+    config->commit_batch = 32;
+
     char line[1024];
     while (fgets(line, sizeof(line), file)) {
         if (line[0] == '#' || line[0] == '\n') {
@@ -70,34 +244,57 @@ int read_config(Config *config) {
 
         char key[256];
         char value[256];
-        if (sscanf(line, "%s %s", key, value) == 2) {
+        if (sscanf(line, "%255s %255s", key, value) == 2) {
             if (strcmp(key, "SHMEM_NAME") == 0) {
-                strncpy(config->shmem_name, value, sizeof(config->shmem_name));
+                char *v = value;
+                if (*v == '"')
+                    v++;
+                v[strcspn(v, "\"")] = '\0';
+                strncpy(config->shmem_name, v, sizeof(config->shmem_name) - 1);
             } else if (strcmp(key, "SHMEM_SIZE") == 0) {
-                config->shmem_size = atoi(value) * 8;
+                config->shmem_size = atoi(value) * 1024;
+            } else if (strcmp(key, "MAX_MSGS_IN_QUEUE") == 0) {
+                config->max_msgs_in_queue = atoi(value);
+            } else if (strcmp(key, "MAX_QUEUES_IN_SHMEM") == 0) {
+                config->max_queues_in_shmem = atoi(value);
+            } else if (strcmp(key, "TRACE_EVENTS") == 0) {
+                config->trace_events = atoi(value);
+            } else if (strcmp(key, "TRACE_DIR") == 0) {
+                strncpy(config->trace_dir, value, sizeof(config->trace_dir) - 1);
+            } else if (strcmp(key, "DURABLE_DIR") == 0) {
+                strncpy(config->durable_dir, value, sizeof(config->durable_dir) - 1);
+            } else if (strcmp(key, "COMMIT_INTERVAL_US") == 0) {
+                config->commit_interval_us = atoi(value);
+            } else if (strcmp(key, "COMMIT_BATCH") == 0) {
+                config->commit_batch = atoi(value);
             }
         }
-
-
     }
+    fclose(file);
 
-    bitmap = (unsigned char *)malloc(config->shmem_size / 8);
-    if (!bitmap) {
-        perror("Failed to allocate memory for bitmap");
+    if (config->shmem_size < MIN_SHMEMSIZE * 1024 || config->shmem_size > MAX_SHMEMSIZE * 1024 ||
+        (config->shmem_size & (config->shmem_size - 1)) != 0) {
+        fprintf(stderr, "SHMEM_SIZE must be a power of 2 between %d and %d KB\n", MIN_SHMEMSIZE, MAX_SHMEMSIZE);
+        return MF_ERROR;
+    }
+    if (config->max_queues_in_shmem < 1 || config->max_queues_in_shmem > MAX_QUEUES) {
+        fprintf(stderr, "MAX_QUEUES_IN_SHMEM must be between 1 and %d\n", MAX_QUEUES);
+        return MF_ERROR;
+    }
+    if (config->max_msgs_in_queue < 1) {
+        fprintf(stderr, "MAX_MSGS_IN_QUEUE must be positive\n");
+        return MF_ERROR;
+    }
+    if (config->commit_interval_us < 0 || config->commit_batch < 1) {
+        fprintf(stderr, "COMMIT_INTERVAL_US must not be negative and COMMIT_BATCH must be positive\n");
         return MF_ERROR;
     }
-    memset(bitmap, 0, config->shmem_size / 8);
-
 
-    fclose(file);
     return MF_SUCCESS;
-
 }
 
 
 int modif_shm_open(const char *name, int oflag, mode_t mode) {
-    static int (*real_open)(const char *, int, mode_t) = NULL;
-
     char *n = strdup(name);
     char *p = n;
     while (*p) {
@@ -132,12 +329,502 @@ int modif_shm_close(const char *name) {
 }
 
 Config config;
-message_queue_t *queue;
 void *shm_addr;
-void *addr_inc;
-int count;
-message_queue_t* addr[5];
-int unallocated;
+static int my_slot = -1; // in the client table, -1 if not registered
+
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t call_cond = PTHREAD_COND_INITIALIZER;
+static pending_call_t *pending_calls;
+static unsigned int call_seq;
+static int reply_reader[MAX_QUEUES]; // a thread is blocked in mf_recv on this reply queue
+static mf_call_stats_t call_stats;
+
+// Trace ring of this process. NULL unless TRACE_EVENTS is set, which is all
+// the instrumented paths check before doing any work.
+static trace_event_t *trace_ring;
+static long trace_size;
+static long trace_next;
+static int trace_pid;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Mappings of durable queue files in this process, indexed by qid.
+typedef struct {
+    int gen;
+    int fd;
+    message_queue_t *mq;
+} durable_map_t;
+
+static durable_map_t durable_maps[MAX_QUEUES];
+static pthread_mutex_t durable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread unsigned long copy_start; // start of the copy between begin and commit
+static __thread int copy_len;
+static __thread unsigned int copy_tag;
+
+#define TRACE_START(t) do { if (trace_ring) (t) = trace_now(); } while (0)
+#define TRACE(type, qid, size, t) do { if (trace_ring) trace_event(type, qid, size, t); } while (0)
+
+
+void set_bitmap(int start, int count);
+void clear_bitmap(int start, int count);
+void init_sems(message_queue_t *mq);
+int find_queue(const char *mqname);
+int compact();
+void unpin_queue(int qid);
+void remove_member(sharded_t *sh, int pos);
+
+shm_header_t *shm_header() {
+    return (shm_header_t *)shm_addr;
+}
+
+unsigned long trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Record an event that started at start (0 for an instant event).
+void trace_event(int type, int qid, int size, unsigned long start) {
+    static __thread int tid;
+    if (tid == 0)
+        tid = syscall(SYS_gettid);
+
+    unsigned long now = trace_now();
+    // filled under the lock so that mf_trace_dump never sees half an event
+    pthread_mutex_lock(&trace_lock);
+    trace_event_t *ev = &trace_ring[trace_next % trace_size];
+    trace_next++;
+    ev->ts = now;
+    ev->dur = start ? now - start : 0;
+    ev->tid = tid;
+    ev->type = type;
+    ev->qid = qid;
+    ev->size = size;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Write the trace ring of this process to TRACE_DIR/mf_trace_<pid>.bin.
+int mf_trace_dump() {
+    if (trace_ring == NULL || trace_pid != getpid())
+        return MF_SUCCESS;
+
+    char path[512];
+    snprintf(path, sizeof(path), TRACE_FILE_FMT, config.trace_dir, trace_pid);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to open trace file");
+        return MF_ERROR;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_file_t th;
+    th.magic = TRACE_MAGIC;
+    th.version = TRACE_VERSION;
+    th.pid = trace_pid;
+    th.count = trace_next < trace_size ? trace_next : trace_size;
+    th.dropped = trace_next - th.count;
+    fwrite(&th, sizeof(th), 1, file);
+    for (long i = trace_next - th.count; i < trace_next; i++)
+        fwrite(&trace_ring[i % trace_size], sizeof(trace_event_t), 1, file);
+    pthread_mutex_unlock(&trace_lock);
+
+    fclose(file);
+    return MF_SUCCESS;
+}
+
+void trace_exit() {
+    mf_trace_dump();
+}
+
+// (Re)start tracing for this process. A forked child that connects again
+// starts with an empty ring instead of the events of its parent.
+void trace_init() {
+    if (config.trace_events <= 0 || trace_pid == getpid())
+        return;
+
+    if (trace_ring == NULL) {
+        trace_ring = calloc(config.trace_events, sizeof(trace_event_t));
+        if (trace_ring == NULL) {
+            perror("Failed to allocate memory for trace ring");
+            return;
+        }
+        trace_size = config.trace_events;
+        atexit(trace_exit);
+    }
+    trace_next = 0;
+    trace_pid = getpid();
+}
+
+int lock_sem(sem_t *sem) {
+    while (sem_wait(sem) != 0) {
+        if (errno != EINTR) {
+            perror("sem_wait error");
+            return MF_ERROR;
+        }
+    }
+    return MF_SUCCESS;
+}
+
+// The header lock records its holder so that mf_restart can tell a lock left
+// by a dead process from one a live client is using.
+int lock_header(shm_header_t *hdr) {
+    if (lock_sem(&hdr->lock) == MF_ERROR)
+        return MF_ERROR;
+    hdr->lock_owner = getpid();
+    return MF_SUCCESS;
+}
+
+void unlock_header(shm_header_t *hdr) {
+    hdr->lock_owner = 0;
+    sem_post(&hdr->lock);
+}
+
+void durable_path(const char *mqname, char *path, int size) {
+    char name[MAX_MQNAMESIZE];
+    strncpy(name, mqname, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    for (char *p = name; *p; p++) {
+        if (*p == '/')
+            *p = '_';
+    }
+    snprintf(path, size, DURABLE_FILE_FMT, config.durable_dir, name);
+}
+
+void unmap_durable(int qid) {
+    durable_map_t *dm = &durable_maps[qid];
+    if (dm->mq != NULL) {
+        munmap(dm->mq, dm->mq->size);
+        close(dm->fd);
+        dm->mq = NULL;
+    }
+}
+
+// Map the file of durable queue qid into this process, or return the
+// mapping made earlier if the queue was not recreated since.
+message_queue_t *map_durable(int qid) {
+    queue_entry_t *e = &shm_header()->queues[qid];
+    durable_map_t *dm = &durable_maps[qid];
+    if (dm->mq != NULL && dm->gen == e->gen)
+        return dm->mq;
+
+    pthread_mutex_lock(&durable_lock);
+    if (dm->mq == NULL || dm->gen != e->gen) {
+        unmap_durable(qid);
+
+        char path[512];
+        struct stat st;
+        durable_path(e->name, path, sizeof(path));
+        int fd = open(path, O_RDWR);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            perror("Failed to open durable queue file");
+            if (fd != -1)
+                close(fd);
+            pthread_mutex_unlock(&durable_lock);
+            return NULL;
+        }
+        void *addr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap failed");
+            close(fd);
+            pthread_mutex_unlock(&durable_lock);
+            return NULL;
+        }
+        dm->fd = fd;
+        dm->gen = e->gen;
+        dm->mq = (message_queue_t *)addr;
+    }
+    pthread_mutex_unlock(&durable_lock);
+    return dm->mq;
+}
+
+message_queue_t *queue_at(int qid) {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return NULL;
+    }
+    if (qid < 0 || qid >= MAX_QUEUES || !shm_header()->queues[qid].used) {
+        fprintf(stderr, "Invalid queue ID or queue does not exist\n");
+        return NULL;
+    }
+    if (shm_header()->queues[qid].durable)
+        return map_durable(qid);
+    return (message_queue_t *)((char *)shm_addr + shm_header()->queues[qid].offset);
+}
+
+// Every call that works on a queue outside the header lock pins it for as
+// long as it holds a pointer to it, sleeping on it included, so that
+// compact does not move the queue under it. The offset is only read once
+// the pin is taken. compact claims a queue by turning 0 pins into -1 and
+// holds the header lock until it is done, so a caller that finds the queue
+// claimed waits for that lock and tries again.
+// The pins of a process are also counted in its client slot, so that
+// release_client gives them back if it dies in the middle of a call. They
+// are added there after the queue's count and taken off before it, so a
+// death in between leaks a pin rather than taking one that is not there.
+message_queue_t *pin_queue(int qid) {
+    if (queue_at(qid) == NULL)
+        return NULL;
+
+    shm_header_t *hdr = shm_header();
+    queue_entry_t *e = &hdr->queues[qid];
+    int pins;
+    while ((pins = e->pins) < 0 || !__sync_bool_compare_and_swap(&e->pins, pins, pins + 1)) {
+        if (pins < 0 && lock_header(hdr) == MF_SUCCESS)
+            unlock_header(hdr);
+    }
+    if (my_slot != -1)
+        __sync_fetch_and_add(&hdr->clients[my_slot].pins[qid], 1);
+
+    message_queue_t *mq = queue_at(qid);
+    if (mq == NULL)
+        unpin_queue(qid);
+    return mq;
+}
+
+void unpin_queue(int qid) {
+    shm_header_t *hdr = shm_header();
+    if (my_slot != -1)
+        __sync_fetch_and_sub(&hdr->clients[my_slot].pins[qid], 1);
+    __sync_fetch_and_sub(&hdr->queues[qid].pins, 1);
+}
+
+int lock_queue(message_queue_t *mq, int qid) {
+    unsigned long t = 0;
+    TRACE_START(t);
+    if (lock_sem(&mq->mutex) == MF_ERROR)
+        return MF_ERROR;
+    TRACE(TR_LOCK, qid, 0, t);
+    return MF_SUCCESS;
+}
+
+// Sleep on cv until woken by wake_all. Must be called with mq->mutex held,
+// returns with it held again.
+void wait_on(message_queue_t *mq, int qid, sem_t *cv, int *waiters) {
+    unsigned long t = 0;
+    TRACE(TR_BLOCK, qid, 0, 0);
+    TRACE_START(t);
+    (*waiters)++;
+    sem_post(&mq->mutex);
+    lock_sem(cv);
+    lock_sem(&mq->mutex);
+    TRACE(TR_WAKE, qid, 0, t);
+}
+
+void wake_all(sem_t *cv, int *waiters) {
+    while (*waiters > 0) {
+        sem_post(cv);
+        (*waiters)--;
+    }
+}
+
+// Wake the ring helpers waiting for mq to change. Called with the queue
+// locked.
+void wake_rings(message_queue_t *mq) {
+    shm_header_t *hdr = shm_header();
+    for (int r = 0; mq->ring_watch != 0; r++) {
+        if (mq->ring_watch & (1u << r)) {
+            sem_post(&hdr->rings[r].wake);
+            mq->ring_watch &= ~(1u << r);
+        }
+    }
+}
+
+// wait_on with a deadline. Returns MF_ERROR if the deadline passed first.
+int wait_on_until(message_queue_t *mq, sem_t *cv, int *waiters, struct timespec *deadline) {
+    (*waiters)++;
+    sem_post(&mq->mutex);
+    int ret;
+    while ((ret = sem_timedwait(cv, deadline)) == -1 && errno == EINTR)
+        ;
+    lock_sem(&mq->mutex);
+    if (ret == 0)
+        return MF_SUCCESS;
+
+    // take ourselves out again, or eat the post that was meant for us
+    if (*waiters > 0)
+        (*waiters)--;
+    else
+        sem_trywait(cv);
+    return MF_ERROR;
+}
+
+// Update the watermark state after the used bytes of mq changed. Called
+// with the queue locked.
+void check_watermarks(message_queue_t *mq) {
+    if (!mq->above_high && mq->used >= mq->high_wm) {
+        mq->above_high = 1;
+        mq->high_crossings++;
+    } else if (mq->above_high && mq->used <= mq->low_wm) {
+        mq->above_high = 0;
+        mq->low_crossings++;
+    } else {
+        return;
+    }
+    mq->wm_seq++;
+    wake_all(&mq->wm_wait, &mq->wm_waiters);
+}
+
+
+// Check that the ring of a queue found in a file is consistent, so that
+// it can be used without trusting anything else about it.
+int validate_ring(message_queue_t *mq, int size) {
+    if (mq->size != size || mq->capacity <= 0 || mq->capacity > size - (int)sizeof(message_queue_t) ||
+        mq->head < 0 || mq->head > mq->capacity || mq->tail < 0 || mq->tail > mq->capacity ||
+        mq->used < 0 || mq->used > mq->capacity || mq->count < 0 || mq->taken < 0)
+        return -1;
+
+    int head = mq->head, used = 0, taken = 0;
+    for (int i = 0; i < mq->count + mq->taken; i++) {
+        message_t *msg = (message_t *)(mq->data + head);
+        if (mq->capacity - head < (int)sizeof(message_t) || msg->datalength == WRAP_MARKER) {
+            used += mq->capacity - head;
+            head = 0;
+            msg = (message_t *)mq->data;
+        }
+        if (msg->datalength < 0 || MSG_LEN(msg) > MAX_DATALEN)
+            return -1;
+        if (msg->datalength & TAKEN_FLAG)
+            taken++;
+        int reclen = sizeof(message_t) + ROUNDUP(MSG_LEN(msg));
+        if (head + reclen > mq->capacity)
+            return -1;
+        head += reclen;
+        used += reclen;
+    }
+    if (used != mq->used || taken != mq->taken || (mq->count > 0 && head != mq->tail))
+        return -1;
+    return 0;
+}
+
+// Put the durable queue files left in DURABLE_DIR back into the queue
+// directory, with the messages that were not received before the restart.
+// Messages received after the last flush are delivered again.
+void recover_durable() {
+    shm_header_t *hdr = shm_header();
+    DIR *dir = opendir(config.durable_dir);
+    if (dir == NULL)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        int len = strlen(de->d_name);
+        if (strncmp(de->d_name, "mf_", 3) != 0 || len < 4 || strcmp(de->d_name + len - 3, ".mq") != 0)
+            continue;
+
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", config.durable_dir, de->d_name);
+        int fd = open(path, O_RDWR);
+        if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(message_queue_t)) {
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+        message_queue_t *mq = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mq == MAP_FAILED)
+            continue;
+
+        mq->name[MAX_MQNAMESIZE - 1] = '\0';
+        int slot = -1, nqueues = 0;
+        for (int i = 0; i < MAX_QUEUES; i++) {
+            if (hdr->queues[i].used)
+                nqueues++;
+            else if (slot == -1)
+                slot = i;
+        }
+
+        if (mq->durable != DURABLE_MAGIC || validate_ring(mq, st.st_size) == -1) {
+            fprintf(stderr, "Skipping corrupt durable queue file %s\n", path);
+        } else if (find_queue(mq->name) != -1 || slot == -1 || nqueues >= hdr->max_queues_in_shmem) {
+            fprintf(stderr, "No room to recover durable queue %s\n", mq->name);
+        } else {
+            init_sems(mq);
+            mq->refcount = 0;
+            mq->committing = 0;
+            mq->commit_seq = mq->send_seq;
+            mq->failed_seq = 0; // what the file holds now is on disk
+            msync(mq, st.st_size, MS_SYNC);
+
+            hdr->queues[slot].offset = 0;
+            hdr->queues[slot].durable = 1;
+            hdr->queues[slot].gen = ++hdr->queue_gen;
+            strncpy(hdr->queues[slot].name, mq->name, MAX_MQNAMESIZE - 1);
+            hdr->queues[slot].used = 1;
+            printf("Recovered durable queue %s with %d messages\n", mq->name, mq->count);
+        }
+        munmap(mq, st.st_size);
+    }
+    closedir(dir);
+}
+
+
+// Number of blocks at the start of the segment taken by the header.
+int header_blocks() {
+    int header_size = sizeof(shm_header_t) + shm_header()->nblocks / 8;
+    return (header_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Slot of the calling process in the client table, registering it first if
+// create is set. Called with the header lock held.
+int client_slot(int create) {
+    shm_header_t *hdr = shm_header();
+    int pid = getpid();
+    int free_slot = -1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (hdr->clients[i].pid == pid)
+            return i;
+        if (hdr->clients[i].pid == 0 && free_slot == -1)
+            free_slot = i;
+    }
+    if (!create)
+        return -1;
+    if (free_slot == -1) {
+        fprintf(stderr, "Too many connected processes, references of pid %d are not tracked\n", pid);
+        return -1;
+    }
+    memset(&hdr->clients[free_slot], 0, sizeof(client_t));
+    hdr->clients[free_slot].pid = pid;
+    hdr->stats.clients_registered++;
+    return free_slot;
+}
+
+// A forked child is not the client its parent registered; it counts its
+// own pins once it connects.
+void forget_slot() {
+    my_slot = -1;
+}
+
+// Drop the references and pins a client still holds and free its slot.
+// Returns the number of references dropped. Called with the header lock held.
+int release_client(int slot) {
+    shm_header_t *hdr = shm_header();
+    client_t *client = &hdr->clients[slot];
+    int released = 0;
+    for (int qid = 0; qid < MAX_QUEUES; qid++) {
+        // nobody can hold -1 while the header lock is held; take off no
+        // more than there are, as other processes pin and unpin meanwhile
+        queue_entry_t *e = &hdr->queues[qid];
+        for (int pins; client->pins[qid] > 0 && e->used && (pins = e->pins) > 0; ) {
+            int drop = client->pins[qid] < pins ? client->pins[qid] : pins;
+            if (__sync_bool_compare_and_swap(&e->pins, pins, pins - drop))
+                client->pins[qid] = 0;
+        }
+        if (client->opens[qid] == 0 || !hdr->queues[qid].used)
+            continue;
+        message_queue_t *mq = queue_at(qid);
+        if (mq != NULL) {
+            lock_sem(&mq->mutex);
+            mq->refcount -= client->opens[qid];
+            if (mq->refcount < 0)
+                mq->refcount = 0;
+            sem_post(&mq->mutex);
+        }
+        released += client->opens[qid];
+    }
+    memset(client, 0, sizeof(client_t));
+    return released;
+}
 
 
 int mf_init() {
@@ -157,40 +844,47 @@ int mf_init() {
 
     if (ftruncate(fd, config.shmem_size) == -1) {
         perror("ftruncate failed");
-        shm_unlink(config.shmem_name);
+        close(fd);
+        modif_shm_close(config.shmem_name);
         return MF_ERROR;
     }
 
 
     shm_addr = mmap(0, config.shmem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    addr_inc = shm_addr;
+    close(fd);
     if (shm_addr == MAP_FAILED) {
         perror("mmap failed");
-        shm_unlink(config.shmem_name);
+        shm_addr = NULL;
+        modif_shm_close(config.shmem_name);
         return MF_ERROR;
     }
 
-    queue = (message_queue_t *) shm_addr;
-    for (int i = 0; i < 2; i++) {
-        char *queue_ptr = (char *)queue + i * (sizeof(message_queue_t) + config.max_msgs_in_queue * MAX_DATALEN);
-        queue = (message_queue_t *)queue_ptr;
-
-        if (sem_init(&queue->mutex, 1, 1) != 0) {
-            perror("sem_init error");
-            munmap(shm_addr, config.shmem_size);
-            shm_unlink(config.shmem_name);
-            return MF_ERROR;
-        }
-
-        queue->head = 0;
-        queue->tail = 0;
-        queue->capacity = config.max_msgs_in_queue * MAX_DATALEN;
+    shm_header_t *hdr = shm_header();
+    memset(hdr, 0, sizeof(shm_header_t));
+    hdr->shmem_size = config.shmem_size;
+    hdr->max_msgs_in_queue = config.max_msgs_in_queue;
+    hdr->max_queues_in_shmem = config.max_queues_in_shmem;
+    hdr->nblocks = config.shmem_size / BLOCK_SIZE;
+    hdr->commit_interval_us = config.commit_interval_us;
+    hdr->commit_batch = config.commit_batch;
+    memset(hdr->bitmap, 0, hdr->nblocks / 8);
+
+    if (sem_init(&hdr->lock, 1, 1) != 0) {
+        perror("sem_init error");
+        munmap(shm_addr, config.shmem_size);
+        modif_shm_close(config.shmem_name);
+        return MF_ERROR;
     }
 
+    for (int r = 0; r < MAX_RINGS; r++)
+        sem_init(&hdr->rings[r].wake, 1, 0);
 
+    // the header itself occupies the first blocks of the segment
+    set_bitmap(0, header_blocks());
 
-    close(fd);
-
+    hdr->magic = MF_MAGIC;
+    trace_init();
+    recover_durable();
     return MF_SUCCESS;
 
 }
@@ -199,22 +893,195 @@ int mf_init() {
 int mf_destroy() {
     int status = 0;
 
+    mf_trace_dump();
     if (modif_shm_close(config.shmem_name) == -1) {
         perror("Error unlinking shared memory");
         status = -1;
     }
 
+    if (shm_addr != NULL) {
+        munmap(shm_addr, config.shmem_size);
+        shm_addr = NULL;
+    }
+
+    return status;
+}
+
+
+// Unmap the segment but leave it, and every queue in it, for the next
+// mfserver started with mf_restart.
+int mf_detach() {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "No shared memory to detach from.\n");
+        return MF_ERROR;
+    }
+
+    mf_trace_dump();
+    munmap(shm_addr, config.shmem_size);
+    shm_addr = NULL;
+    return MF_SUCCESS;
+}
+
+// Take sem, giving up after timeout_ms. A semaphore that stays taken that
+// long is taken to be held by the previous server, which died holding it.
+int lock_sem_timed(sem_t *sem, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int ret;
+    while ((ret = sem_timedwait(sem, &deadline)) == -1 && errno == EINTR)
+        ;
+    return ret == 0 ? MF_SUCCESS : MF_ERROR;
+}
+
+// Check one queue of an adopted segment. Returns -1 if it is not usable.
+// Called with the header lock held.
+int adopt_queue(int qid) {
+    shm_header_t *hdr = shm_header();
+    queue_entry_t *e = &hdr->queues[qid];
+    message_queue_t *mq;
+    int start = 0, num_blocks = 0;
+
+    e->name[MAX_MQNAMESIZE - 1] = '\0';
+    if (e->durable) {
+        mq = queue_at(qid);
+        if (mq == NULL || mq->durable != DURABLE_MAGIC)
+            return -1;
+    } else {
+        if (e->offset % BLOCK_SIZE != 0 || e->offset < header_blocks() * BLOCK_SIZE ||
+            e->offset + (int)sizeof(message_queue_t) > hdr->shmem_size)
+            return -1;
+        mq = (message_queue_t *)((char *)shm_addr + e->offset);
+        start = e->offset / BLOCK_SIZE;
+        num_blocks = mq->size / BLOCK_SIZE;
+        if (mq->size % BLOCK_SIZE != 0 || start + num_blocks > hdr->nblocks)
+            return -1;
+        for (int i = start; i < start + num_blocks; i++) {
+            if (hdr->bitmap[i / 8] & (1 << (i % 8)))
+                return -1; // overlaps a queue adopted before
+        }
+    }
+
+    // a server that died in compact leaves its claim on the queue; the
+    // copy it was moving from is checked below like any other
+    if (e->pins < 0)
+        e->pins = 0;
+
+    // Clients keep using the queue while we look at it. A queue lock that
+    // is never given back on a queue nobody has open was taken by a client
+    // that died holding it.
+    int locked = lock_sem_timed(&mq->mutex, 1000) == MF_SUCCESS;
+    if (!locked && mq->refcount > 0) {
+        fprintf(stderr, "Queue %s stays locked, adopted without checking it\n", e->name);
+    } else {
+        int ok = validate_ring(mq, mq->size) == 0;
+        if (!locked && ok)
+            init_sems(mq);
+        else if (locked)
+            sem_post(&mq->mutex);
+        if (!ok)
+            return -1;
+    }
+    if (!e->durable)
+        set_bitmap(start, num_blocks);
+    return 0;
+}
+
+// Adopt the segment left by the previous mfserver instead of creating a
+// new one, so that connected clients and the messages in their queues
+// survive a server restart. The queue directory and every ring are checked
+// and the block bitmap is rebuilt from them; queues that do not hold
+// together are dropped. Fails if there is no usable segment, in which case
+// mf_init starts from scratch.
+int mf_restart() {
+    if (read_config(&config) == MF_ERROR) {
+        fprintf(stderr, "Error reading config\n");
+        return MF_ERROR;
+    }
+
+    int fd = modif_shm_open(config.shmem_name, O_RDWR, 0666);
+    if (fd == -1) {
+        perror("shm_open failed");
+        return MF_ERROR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != config.shmem_size) {
+        fprintf(stderr, "Shared memory %s does not have the configured size\n", config.shmem_name);
+        close(fd);
+        return MF_ERROR;
+    }
+    shm_addr = mmap(0, config.shmem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm_addr == MAP_FAILED) {
+        perror("mmap failed");
+        shm_addr = NULL;
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    if (hdr->magic != MF_MAGIC || hdr->shmem_size != config.shmem_size ||
+        hdr->nblocks != config.shmem_size / BLOCK_SIZE) {
+        fprintf(stderr, "Shared memory %s was not left by mfserver\n", config.shmem_name);
+        munmap(shm_addr, config.shmem_size);
+        shm_addr = NULL;
+        return MF_ERROR;
+    }
+
+    // Only reset a lock whose holder is gone; a live client will give it
+    // back. No owner on two timeouts in a row means the holder died right
+    // after taking it.
+    int unowned = 0;
+    while (lock_sem_timed(&hdr->lock, 1000) == MF_ERROR) {
+        pid_t owner = hdr->lock_owner;
+        if (owner != 0 && (kill(owner, 0) == 0 || errno == EPERM)) {
+            fprintf(stderr, "Header lock held by live process %d, waiting\n", (int)owner);
+            unowned = 0;
+            continue;
+        }
+        if (owner == 0 && !unowned++)
+            continue;
+        fprintf(stderr, "Header lock holder %d is gone, resetting the lock\n", (int)owner);
+        sem_init(&hdr->lock, 1, 0);
+        break;
+    }
+    hdr->lock_owner = getpid();
 
-    for (int i = 0; i < 2; i++) {
-        char queue_name[256];
-        snprintf(queue_name, sizeof(queue_name), "/libmf_semaphore_%d", i);
-        if (sem_unlink(queue_name) == -1) {
-            perror("Error unlinking semaphore");
-            status = -1;
+    memset(hdr->bitmap, 0, hdr->nblocks / 8);
+    set_bitmap(0, header_blocks());
+    int adopted = 0, dropped = 0;
+    for (int qid = 0; qid < MAX_QUEUES; qid++) {
+        if (!hdr->queues[qid].used)
+            continue;
+        if (adopt_queue(qid) == 0) {
+            adopted++;
+        } else {
+            fprintf(stderr, "Dropping corrupt queue %s\n", hdr->queues[qid].name);
+            hdr->queues[qid].used = 0;
+            dropped++;
         }
     }
+    for (int i = 0; i < MAX_SHARDED; i++) {
+        sharded_t *sh = &hdr->sharded[i];
+        if (sh->used == 2)
+            sh->used = 0; // creation or removal did not finish
+        for (int s = 0; sh->used && s < sh->nshards; s++) {
+            if (sh->shards[s] < 0 || sh->shards[s] >= MAX_QUEUES || !hdr->queues[sh->shards[s]].used)
+                sh->used = 0;
+        }
+    }
+    hdr->stats.warm_restarts++;
+    hdr->stats.queues_dropped += dropped;
+    unlock_header(hdr);
 
-    return status;
+    printf("Shared Memory Name: %s\n", config.shmem_name);
+    printf("Adopted %d queues, dropped %d\n", adopted, dropped);
+    trace_init();
+    return MF_SUCCESS;
 }
 
 
@@ -225,7 +1092,6 @@ int mf_connect()
         fprintf(stderr, "Error reading config\n");
         return MF_ERROR;
     }
-    printf("%d",config.shmem_size);
     int fd = modif_shm_open(config.shmem_name, O_RDWR, 0666);
     if (fd == -1) {
         perror("shm_open failed");
@@ -236,13 +1102,27 @@ int mf_connect()
 
     if (shm_addr == MAP_FAILED) {
         perror("mmap failed");
+        shm_addr = NULL;
         close(fd);
         return MF_ERROR;
     }
-
-    printf("Connection succesful");
     close(fd);
 
+    if (shm_header()->magic != MF_MAGIC || shm_header()->shmem_size != config.shmem_size) {
+        fprintf(stderr, "Shared memory is not initialized by mfserver\n");
+        munmap(shm_addr, config.shmem_size);
+        shm_addr = NULL;
+        return MF_ERROR;
+    }
+
+    lock_header(shm_header());
+    my_slot = client_slot(1);
+    unlock_header(shm_header());
+    static int atfork_set;
+    if (!atfork_set++)
+        pthread_atfork(NULL, NULL, forget_slot);
+
+    trace_init();
     return MF_SUCCESS;
 }
 
@@ -252,6 +1132,26 @@ int mf_disconnect() {
         return MF_ERROR;
     }
 
+    // queues left open are closed and consumer groups left here
+    shm_header_t *hdr = shm_header();
+    lock_header(hdr);
+    int slot = client_slot(0);
+    if (slot != -1)
+        release_client(slot);
+    my_slot = -1;
+    for (int i = 0; i < MAX_SHARDED; i++) {
+        sharded_t *sh = &hdr->sharded[i];
+        if (sh->used != 1)
+            continue;
+        lock_sem(&sh->lock);
+        for (int p = sh->nmembers - 1; p >= 0; p--) {
+            if (sh->members[p].pid == getpid())
+                remove_member(sh, p);
+        }
+        sem_post(&sh->lock);
+    }
+    unlock_header(hdr);
+
 
     if (munmap(shm_addr, config.shmem_size) == -1) {
         perror("Error unmapping shared memory during disconnect");
@@ -259,51 +1159,73 @@ int mf_disconnect() {
     }
 
     shm_addr = NULL;
-    printf("Disconnect succesful");
+    mf_trace_dump();
     return MF_SUCCESS;
 }
 
 
 void set_bitmap(int start, int count) {
+    unsigned char *bitmap = shm_header()->bitmap;
     for (int i = start; i < start + count; i++) {
         bitmap[i / 8] |= 1 << (i % 8);
     }
 }
 
 void clear_bitmap(int start, int count) {
+    unsigned char *bitmap = shm_header()->bitmap;
     for (int i = start; i < start + count; i++) {
         bitmap[i / 8] &= ~(1 << (i % 8));
     }
-    printf("Cleared\n");
 }
 
 
+void init_sems(message_queue_t *mq) {
+    sem_init(&mq->mutex, 1, 1);
+    sem_init(&mq->recv_wait, 1, 0);
+    sem_init(&mq->send_wait, 1, 0);
+    sem_init(&mq->commit_wait, 1, 0);
+    sem_init(&mq->batch_wait, 1, 0);
+    sem_init(&mq->wm_wait, 1, 0);
+    mq->recv_waiters = 0;
+    mq->send_waiters = 0;
+    mq->commit_waiters = 0;
+    mq->wm_waiters = 0;
+    for (int i = 0; i < MAX_FILTERS; i++) {
+        sem_init(&mq->filters[i].wait, 1, 0);
+        mq->filters[i].used = 0;
+        mq->filters[i].waiters = 0;
+    }
+}
+
+void init_queue(message_queue_t *mq, int size, const char *mqname) {
+    memset(mq, 0, sizeof(message_queue_t));
+    mq->size = size;
+    mq->capacity = (size - sizeof(message_queue_t)) & ~(MSG_ALIGN - 1);
+    strncpy(mq->name, mqname, MAX_MQNAMESIZE - 1);
+    mq->high_wm = mq->capacity / 4 * 3;
+    mq->low_wm = mq->capacity / 4;
+    mq->wm_seq = 1; // 0 is what mf_wait_watermark callers start with
+    init_sems(mq);
+}
+
+// First fit search for mqsize KB of consecutive free blocks. Called with the
+// header lock held.
 int allocate(int mqsize, void* shm_addr, message_queue_t** mq, const char *mqname) {
+    shm_header_t *hdr = (shm_header_t *)shm_addr;
     int free_count = 0, start = -1;
-    int num_blocks = 8 * mqsize;
-    for (int i = 0; i < config.shmem_size / 8; i++) {
-        for (int bit = 0; bit < 8; ++bit) {
-            if (!(bitmap[i] & (1 << bit))) {
-                if (free_count == 0) start = i * 8 + bit;
-                free_count++;
-                if (free_count == num_blocks) {
-                    set_bitmap(start, num_blocks);
-                    *mq = (message_queue_t*)((char*)shm_addr + start);
-                    (*mq)->head = (*mq)->data;
-                    (*mq)->tail = (*mq)->data + num_blocks;
-                    (*mq)->capacity = num_blocks;
-                    (*mq)->name = strdup(mqname);
-                    (*mq)->base_ptr = (*mq)->head;
-                    sem_init(&((*mq)->mutex), 1, 1);
-                    printf("Base %p\n", shm_addr);
-                    printf("Message queue created with name %s at %p\n", mqname, (*mq)->head);
-                    printf("Message queue ends at %p\n", (*mq)->tail);
-                    printf("Allocated %d blocks starting at %d (bitmap idx %d, bit %d)\n", num_blocks, start, i, bit);
-                    return 0;
-                }
-            } else {
-                free_count = 0;
+    int num_blocks = mqsize * 1024 / BLOCK_SIZE;
+    for (int i = 0; i < hdr->nblocks; i++) {
+        if (!(hdr->bitmap[i / 8] & (1 << (i % 8)))) {
+            if (free_count == 0) start = i;
+            free_count++;
+            if (free_count == num_blocks) {
+                set_bitmap(start, num_blocks);
+                *mq = (message_queue_t*)((char*)shm_addr + start * BLOCK_SIZE);
+                init_queue(*mq, num_blocks * BLOCK_SIZE, mqname);
+                return 0;
             }
+        } else {
+            free_count = 0;
         }
     }
 
@@ -312,386 +1234,1778 @@ int allocate(int mqsize, void* shm_addr, message_queue_t** mq, const char *mqnam
 
 void deallocate(message_queue_t* mq, void* shm_addr) {
     int start = ((char*)mq - (char*)shm_addr) / BLOCK_SIZE;
-    int num_blocks = mq->capacity / BLOCK_SIZE;
+    int num_blocks = mq->size / BLOCK_SIZE;
     clear_bitmap(start, num_blocks);
 }
 
 
-Queue* initializeQueue(Queue* queue) {
-    queue = (Queue*)malloc(sizeof(Queue));
-
-    if (queue == NULL) {
-        perror("Failed to allocate memory for queue");
-        exit(EXIT_FAILURE);
+int find_queue(const char *mqname) {
+    shm_header_t *hdr = shm_header();
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (hdr->queues[i].used && strcmp(hdr->queues[i].name, mqname) == 0)
+            return i;
     }
-
-    queue->front = NULL;
-    queue->rear = NULL;
-    return queue;
+    return -1;
 }
 
 
-//offset ekle
-int mf_create(char *mqname, int mqsize) {
+// Create the file of a durable queue. Called with the header lock held.
+int create_durable(int mqsize, message_queue_t **mq, const char *mqname) {
+    char path[512];
+    durable_path(mqname, path, sizeof(path));
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd == -1) {
+        perror("Failed to create durable queue file");
+        return -1;
+    }
+    if (ftruncate(fd, mqsize * 1024) == -1) {
+        perror("ftruncate failed");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    void *addr = mmap(0, mqsize * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("mmap failed");
+        unlink(path);
+        return -1;
+    }
+
+    *mq = (message_queue_t *)addr;
+    init_queue(*mq, mqsize * 1024, mqname);
+    (*mq)->durable = DURABLE_MAGIC;
+    msync(addr, mqsize * 1024, MS_SYNC);
+    munmap(addr, mqsize * 1024);
+    return 0;
+}
+
+int create_queue(char *mqname, int mqsize, int durable) {
 
     message_queue_t *mq;
 
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+    if (mqsize < MIN_MQSIZE || mqsize > MAX_MQSIZE || mqsize % 4 != 0) {
+        fprintf(stderr, "Queue size must be a multiple of 4 between %d and %d KB\n", MIN_MQSIZE, MAX_MQSIZE);
+        return MF_ERROR;
+    }
+    if (strlen(mqname) >= MAX_MQNAMESIZE) {
+        fprintf(stderr, "Queue name is too long\n");
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+
+    if (find_queue(mqname) != -1) {
+        fprintf(stderr, "A message queue named %s already exists\n", mqname);
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
 
     int isfull = 0;
+    int slot = -1;
+    for (int j = 0; j < MAX_QUEUES; j++) {
+        if (hdr->queues[j].used)
+            isfull++;
+        else if (slot == -1)
+            slot = j;
+    }
 
-    for(int j = 0 ; j < 5 ; j++){
-        if(addr[j] != NULL){
-            isfull ++;
+    if (isfull >= hdr->max_queues_in_shmem || slot == -1) {
+        fprintf(stderr, "max number of message queues are already reached\n");
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
 
+    if (durable) {
+        if (create_durable(mqsize, &mq, mqname) == -1) {
+            unlock_header(hdr);
+            return MF_ERROR;
+        }
+        hdr->queues[slot].offset = 0;
+    } else {
+        int stat = allocate(mqsize , shm_addr, &mq, mqname);
+        if (stat == -1 && compact() > 0)
+            stat = allocate(mqsize, shm_addr, &mq, mqname);
+        if ( stat == -1) {
+            fprintf(stderr, "no space for allocation\n");
+            unlock_header(hdr);
+            return MF_ERROR;
         }
+        hdr->queues[slot].offset = (char *)mq - (char *)shm_addr;
     }
 
-    if(isfull == 5){
-        perror("max number of message queues are already reached");
+    strncpy(hdr->queues[slot].name, mqname, MAX_MQNAMESIZE - 1);
+    hdr->queues[slot].durable = durable;
+    hdr->queues[slot].gen = ++hdr->queue_gen;
+    hdr->queues[slot].used = 1;
+
+    unlock_header(hdr);
+    return MF_SUCCESS;
+
+}
+
+int mf_create(char *mqname, int mqsize) {
+    return create_queue(mqname, mqsize, 0);
+}
+
+// Like mf_create, but the queue is kept in a file under DURABLE_DIR. Sends
+// return once the message is flushed to the file, and the messages left in
+// the queue are recovered by mf_init after a restart.
+int mf_create_durable(char *mqname, int mqsize) {
+    return create_queue(mqname, mqsize, 1);
+}
+
+
+int mf_remove(char *mqname) {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
         return MF_ERROR;
     }
 
-    int stat = allocate(mqsize , shm_addr, &mq, mqname);
-    if ( stat == -1) {
-        perror("no space for allocation");
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+
+    int i = find_queue(mqname);
+    if (i == -1) {
+        fprintf(stderr, "No message queue named %s\n", mqname);
+        unlock_header(hdr);
         return MF_ERROR;
     }
 
-    for(int i = 0 ; i < 5 ; i++){
-        if(addr[i] == NULL){
-            addr[i] = mq;
-            break;
+    message_queue_t *mq = queue_at(i);
+    // claimed like compact does, so that no call can pin it while it goes
+    if (mq->refcount != 0 || !__sync_bool_compare_and_swap(&hdr->queues[i].pins, 0, -1)) {
+        printf("The reference count is not zero\n");
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
 
-        }
+    if (hdr->queues[i].durable) {
+        char path[512];
+        durable_path(mqname, path, sizeof(path));
+        unmap_durable(i);
+        if (unlink(path) == -1)
+            perror("Failed to remove durable queue file");
+    } else {
+        deallocate(mq, shm_addr);
     }
+    hdr->queues[i].used = 0;
+    __sync_lock_release(&hdr->queues[i].pins);
+    for (int c = 0; c < MAX_CLIENTS; c++)
+        hdr->clients[c].opens[i] = 0;
 
-    mq->waitlist = initializeQueue(mq->waitlist);
+    unlock_header(hdr);
     return MF_SUCCESS;
+}
+
 
+int mf_open(char *mqname) {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+
+    int i = find_queue(mqname);
+    message_queue_t *mq = i != -1 ? queue_at(i) : NULL;
+    if (mq == NULL) {
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
+
+    lock_sem(&mq->mutex);
+    mq->refcount++;
+    sem_post(&mq->mutex);
+
+    int slot = client_slot(1);
+    if (slot != -1)
+        hdr->clients[slot].opens[i]++;
+
+    unlock_header(hdr);
+    return i;
 }
 
 
-int mf_remove(char *mqname) {
-    int i;
+int mf_close(int qid) {
+
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+    // resolved under the header lock, so compact cannot move it meanwhile
+    message_queue_t *mq = queue_at(qid);
+    if (mq == NULL) {
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
+    if (lock_sem(&mq->mutex) == MF_ERROR) {
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
+
+    if (mq->refcount <= 0) {
+        fprintf(stderr, "Reference count negative. Possible underflow error.\n");
+        sem_post(&mq->mutex);
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
+    mq->refcount--;
+
+    sem_post(&mq->mutex);
+
+    int slot = client_slot(0);
+    if (slot != -1 && hdr->clients[slot].opens[qid] > 0)
+        hdr->clients[slot].opens[qid]--;
+    unlock_header(hdr);
+
+    return MF_SUCCESS;
+}
 
-    for (i = 0; i < 5; i++) {
-        if (addr[i] != NULL && strcmp(addr[i]->name, mqname) == 0) {
-            if (addr[i]->refcount != 0) {
-                printf("The reference count is not zero\n");
-                return MF_ERROR;
+
+// Release the references of clients that died without closing their
+// queues. Returns the number of clients reaped.
+int mf_reap() {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+
+    int reaped = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        int pid = hdr->clients[i].pid;
+        if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+        int released = release_client(i);
+        hdr->stats.clients_reaped++;
+        hdr->stats.refs_released += released;
+        reaped++;
+        printf("Reaped dead client pid=%d, released %d queue references\n", pid, released);
+    }
+
+    for (int i = 0; i < MAX_SHARDED; i++) {
+        sharded_t *sh = &hdr->sharded[i];
+        if (sh->used != 1)
+            continue;
+        lock_sem(&sh->lock);
+        for (int p = sh->nmembers - 1; p >= 0; p--) {
+            int pid = sh->members[p].pid;
+            if (kill(pid, 0) == -1 && errno == ESRCH) {
+                remove_member(sh, p);
+                hdr->stats.members_reaped++;
+                printf("Removed dead consumer pid=%d from group %s\n", pid, sh->name);
             }
+        }
+        sem_post(&sh->lock);
+    }
+
+    unlock_header(hdr);
+    return reaped;
+}
 
-            deallocate(addr[i], shm_addr);
+// Slide idle queues down to the lowest free blocks so that the free space
+// ends up in one piece at the end of the segment. Only queues that nobody
+// has open and that compact could claim from pin_queue are moved: no call
+// is working on them or sleeping on them, and none can start until the
+// header lock is given back. Returns the number of queues moved. Called
+// with the header lock held.
+int compact() {
+    shm_header_t *hdr = shm_header();
+    int order[MAX_QUEUES];
+    int n = 0;
+
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (hdr->queues[i].used && !hdr->queues[i].durable)
+            order[n++] = i;
+    }
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0 && hdr->queues[order[j]].offset < hdr->queues[order[j - 1]].offset; j--) {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
 
-            addr[i] = NULL;
-            break;
+    int moved = 0;
+    int cursor = header_blocks();
+    for (int i = 0; i < n; i++) {
+        queue_entry_t *e = &hdr->queues[order[i]];
+        message_queue_t *mq = (message_queue_t *)((char *)shm_addr + e->offset);
+        int start = e->offset / BLOCK_SIZE;
+        int num_blocks = mq->size / BLOCK_SIZE;
+
+        if (start > cursor && mq->refcount == 0 && __sync_bool_compare_and_swap(&e->pins, 0, -1)) {
+            message_queue_t *dst = (message_queue_t *)((char *)shm_addr + cursor * BLOCK_SIZE);
+            memmove(dst, mq, mq->size);
+            init_sems(dst); // nobody holds or waits on them
+            clear_bitmap(start, num_blocks);
+            set_bitmap(cursor, num_blocks);
+            e->offset = cursor * BLOCK_SIZE;
+            __sync_lock_release(&e->pins); // 0, after the new offset
+
+            hdr->stats.queues_moved++;
+            hdr->stats.bytes_moved += dst->size;
+            moved++;
+            printf("Moved queue %s from block %d to block %d\n", dst->name, start, cursor);
+            start = cursor;
         }
+        cursor = start + num_blocks;
+    }
+
+    if (moved > 0)
+        hdr->stats.compactions++;
+    return moved;
+}
+
+// Compact the segment if its free space is split in more than one piece.
+int mf_compact() {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+
+    int holes = 0, in_hole = 0;
+    for (int i = 0; i < hdr->nblocks; i++) {
+        int free_block = !(hdr->bitmap[i / 8] & (1 << (i % 8)));
+        if (free_block && !in_hole)
+            holes++;
+        in_hole = free_block;
     }
 
+    int moved = holes > 1 ? compact() : 0;
+    unlock_header(hdr);
+    return moved;
+}
+
+int mf_server_stats(mf_server_stats_t *stats) {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+    *stats = hdr->stats;
+    stats->clients = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (hdr->clients[i].pid != 0)
+            stats->clients++;
+    }
+    unlock_header(hdr);
     return MF_SUCCESS;
 }
 
 
-int mf_open(char *mqname) {
-    for (int i = 0; i < 5; i++) {
+// Bytes needed in the ring for a record of reclen bytes, including the
+// padding skipped at the end of the ring if the record has to wrap.
+int ring_need(message_queue_t *mq, int reclen) {
+    int need = reclen;
+    if (mq->tail + reclen > mq->capacity)
+        need += mq->capacity - mq->tail;
+    return need;
+}
 
-        if (addr[i] != NULL && strcmp(addr[i]->name, mqname) == 0) {
-            if (sem_wait(&addr[i]->mutex) != 0) {
-                perror("Error semaphore");
-                return -1;
-            }
+int ring_fits(message_queue_t *mq, int reclen) {
+    return mq->count < shm_header()->max_msgs_in_queue &&
+           mq->capacity - mq->used >= ring_need(mq, reclen);
+}
 
-            addr[i]->refcount++;
+// Reserve reclen bytes at the tail. The caller checked ring_fits.
+message_t *ring_put(message_queue_t *mq, int reclen) {
+    if (mq->tail + reclen > mq->capacity) {
+        if (mq->capacity - mq->tail >= (int)sizeof(message_t))
+            ((message_t *)(mq->data + mq->tail))->datalength = WRAP_MARKER;
+        mq->used += mq->capacity - mq->tail;
+        mq->tail = 0;
+    }
+    message_t *msg = (message_t *)(mq->data + mq->tail);
+    mq->tail += reclen;
+    mq->used += reclen;
+    mq->count++;
+    return msg;
+}
 
-            if (sem_post(&addr[i]->mutex) != 0) {
-                perror("Error semaphore");
-                return -1;
-            }
-            return i;
+// Oldest message in the queue, giving back the space of messages taken
+// by mf_recv_match on the way. The caller checked count > 0.
+message_t *ring_peek(message_queue_t *mq) {
+    for (;;) {
+        if (mq->capacity - mq->head < (int)sizeof(message_t) ||
+            ((message_t *)(mq->data + mq->head))->datalength == WRAP_MARKER) {
+            mq->used -= mq->capacity - mq->head;
+            mq->head = 0;
         }
+        message_t *msg = (message_t *)(mq->data + mq->head);
+        if (!(msg->datalength & TAKEN_FLAG))
+            return msg;
+        int reclen = sizeof(message_t) + ROUNDUP(MSG_LEN(msg));
+        mq->head += reclen;
+        mq->used -= reclen;
+        mq->taken--;
     }
-    return -1;
 }
 
+// Remove msg from the queue. Only the message at the head gives back its
+// space now, others are marked taken.
+void ring_pop(message_queue_t *mq, message_t *msg) {
+    if ((char *)msg == mq->data + mq->head) {
+        int reclen = sizeof(message_t) + ROUNDUP(msg->datalength);
+        mq->head += reclen;
+        mq->used -= reclen;
+    } else {
+        msg->datalength |= TAKEN_FLAG;
+        mq->taken++;
+    }
+    mq->count--;
+    if (mq->count == 0) {
+        mq->head = 0;
+        mq->tail = 0;
+        mq->used = 0;
+        mq->taken = 0;
+    }
+}
 
-//qid is passable
-int mf_close(int qid) {
+// Oldest message with (tag & mask) == value, or NULL.
+message_t *ring_find(message_queue_t *mq, unsigned int mask, unsigned int value) {
+    if (mq->count == 0)
+        return NULL;
 
-    if (qid < 0 || qid >= 5) {
-        fprintf(stderr, "Invalid queue ID\n");
-        return -1;
+    message_t *msg = ring_peek(mq);
+    int head = (char *)msg - mq->data;
+    for (int i = 0; i < mq->count + mq->taken; i++) {
+        msg = (message_t *)(mq->data + head);
+        if (mq->capacity - head < (int)sizeof(message_t) || msg->datalength == WRAP_MARKER) {
+            head = 0;
+            msg = (message_t *)mq->data;
+        }
+        if (!(msg->datalength & TAKEN_FLAG) && (msg->tag & mask) == value)
+            return msg;
+        head += sizeof(message_t) + ROUNDUP(MSG_LEN(msg));
     }
+    return NULL;
+}
 
 
-    if (addr[qid] == NULL) {
-        fprintf(stderr, "No queue exists at this ID\n");
-        return -1;
+// Wait until the message just put into durable queue mq is flushed to its
+// file. The first sender to get here becomes the committer: it gives other
+// senders up to COMMIT_INTERVAL_US (or until COMMIT_BATCH of them are
+// waiting) to join, then flushes all of them with one msync and fdatasync
+// while the others sleep. The flush runs without the queue lock, so that
+// receivers and senders go on meanwhile. Once a flush fails, that message
+// and every one after it is reported as MF_ERROR: after a failed
+// fdatasync the kernel may have dropped the dirty pages, so a later flush
+// that succeeds does not mean they reached the disk. Called with the queue
+// locked, unlocks it.
+int durable_commit(message_queue_t *mq, int qid) {
+    shm_header_t *hdr = shm_header();
+    unsigned long seq = ++mq->send_seq;
+    int status = MF_SUCCESS;
+
+    if (mq->committing && mq->send_seq - mq->commit_seq >= (unsigned long)hdr->commit_batch)
+        sem_post(&mq->batch_wait);
+
+    while (mq->commit_seq < seq) {
+        if (mq->committing) {
+            wait_on(mq, qid, &mq->commit_wait, &mq->commit_waiters);
+            continue;
+        }
+
+        mq->committing = 1;
+        if (mq->send_seq - mq->commit_seq < (unsigned long)hdr->commit_batch && hdr->commit_interval_us > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += hdr->commit_interval_us * 1000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+
+            sem_post(&mq->mutex);
+            while (sem_timedwait(&mq->batch_wait, &deadline) == -1 && errno == EINTR)
+                ;
+            lock_sem(&mq->mutex);
+            while (sem_trywait(&mq->batch_wait) == 0)
+                ;
+        }
+
+        // committing keeps other senders from starting a flush meanwhile
+        unsigned long target = mq->send_seq;
+        sem_post(&mq->mutex);
+        int flushed = msync(mq, mq->size, MS_SYNC) == 0 && fdatasync(durable_maps[qid].fd) == 0;
+        if (!flushed)
+            perror("Failed to flush durable queue");
+        lock_sem(&mq->mutex);
+
+        if (!flushed && mq->failed_seq == 0)
+            mq->failed_seq = mq->commit_seq + 1;
+        mq->commit_seq = target;
+        mq->commits++;
+        mq->committing = 0;
+        wake_all(&mq->commit_wait, &mq->commit_waiters);
     }
 
+    if (mq->failed_seq != 0 && seq >= mq->failed_seq)
+        status = MF_ERROR;
+    sem_post(&mq->mutex);
+    return status;
+}
+
+// Reserve room for a message of datalen bytes at the tail of the queue,
+// waiting while the queue is full, or setting *full and returning NULL if
+// full is given. Returns where the data goes, with the queue locked and
+// pinned until mf_send_commit.
+void *send_begin(int qid, int datalen, unsigned int tag, int *full) {
 
-    if (sem_wait(&addr[qid]->mutex) != 0) {
-        perror("sem_wait error");
-        return -1;
+    if (datalen < 0 || datalen > MAX_DATALEN) {
+        fprintf(stderr, "Data length must be at most %d bytes\n", MAX_DATALEN);
+        return NULL;
     }
 
-    addr[qid]->refcount--;
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return NULL;
 
-    if (addr[qid]->refcount < 0) {
-        fprintf(stderr, "Reference count negative. Possible underflow error.\n");
-        sem_post(&addr[qid]->mutex);
-        return -1;
+    int reclen = sizeof(message_t) + ROUNDUP(datalen);
+    if (reclen > queue->capacity) {
+        fprintf(stderr, "Message does not fit in the queue\n");
+        unpin_queue(qid);
+        return NULL;
     }
 
+    if (lock_queue(queue, qid) == MF_ERROR) {
+        unpin_queue(qid);
+        return NULL;
+    }
 
-    if (sem_post(&addr[qid]->mutex) != 0) {
-        perror("sem_post error");
-        return -1;
+    if (!ring_fits(queue, reclen) && full != NULL) {
+        sem_post(&queue->mutex);
+        unpin_queue(qid);
+        *full = 1;
+        return NULL;
     }
-    printf("Queue %d closed. Reference count is now %d.\n", qid, addr[qid]->refcount);
+    if (!ring_fits(queue, reclen))
+        queue->send_blocks++;
+    while (!ring_fits(queue, reclen))
+        wait_on(queue, qid, &queue->send_wait, &queue->send_waiters);
 
-    return 0;  }
+    TRACE_START(copy_start);
+    message_t* message = ring_put(queue, reclen);
+    message->datalength = datalen;
+    message->tag = tag;
+    copy_len = datalen;
+    copy_tag = tag;
+    return message->data;
+}
 
-int isEmpty(Queue* queue) {
-    return (queue->front == NULL);
+void *mf_send_begin(int qid, int datalen) {
+    return send_begin(qid, datalen, 0, NULL);
 }
 
-void enqueue(Queue* queue, message_t* data) {
-    QueueNode* newNode = (QueueNode*)malloc(sizeof(QueueNode));
-    if (newNode == NULL) {
-        perror("Failed to allocate memory for new node");
-        exit(EXIT_FAILURE);
-    }
-    newNode->data = data;
-    newNode->next = NULL;
+// Publish the message reserved by mf_send_begin and unlock the queue.
+int mf_send_commit(int qid) {
+    message_queue_t *queue = queue_at(qid);
+    if (queue == NULL)
+        return MF_ERROR;
 
-    if (isEmpty(queue)) {
-        queue->front = newNode;
-        queue->rear = newNode;
-    } else {
-        queue->rear->next = newNode;
-        queue->rear = newNode;
+    TRACE(TR_ENQUEUE, qid, copy_len, copy_start);
+
+    queue->sends++;
+    check_watermarks(queue);
+    wake_all(&queue->recv_wait, &queue->recv_waiters);
+    wake_rings(queue);
+    for (int i = 0; i < MAX_FILTERS; i++) {
+        recv_filter_t *f = &queue->filters[i];
+        if (f->used && (copy_tag & f->mask) == f->value)
+            wake_all(&f->wait, &f->waiters);
     }
+
+    int status = MF_SUCCESS;
+    if (queue->durable)
+        status = durable_commit(queue, qid);
+    else
+        sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return status;
+}
+
+int mf_send(int qid, void *bufptr, int datalen) {
+    return mf_send_tagged(qid, 0, bufptr, datalen);
 }
 
-message_t* dequeue(Queue* queue) {
-    if (isEmpty(queue)) {
-        fprintf(stderr, "Error: Queue is empty\n");
-        exit(EXIT_FAILURE);
+int mf_send_tagged(int qid, unsigned int tag, void *bufptr, int datalen) {
+    void *data = send_begin(qid, datalen, tag, NULL);
+    if (data == NULL)
+        return MF_ERROR;
+
+    memcpy(data, bufptr, datalen);
+    return mf_send_commit(qid);
+}
+
+// Send without waiting. Returns MF_FULL if the message does not fit now.
+int send_nowait(int qid, void *bufptr, int datalen) {
+    int full = 0;
+    void *data = send_begin(qid, datalen, 0, &full);
+    if (data == NULL)
+        return full ? MF_FULL : MF_ERROR;
+
+    memcpy(data, bufptr, datalen);
+    return mf_send_commit(qid);
+}
+
+
+// Wait for a message and return where its data is, leaving it in the queue
+// and the queue locked and pinned until mf_recv_commit or mf_recv_cancel.
+void *recv_begin(int qid, int *datalen, int block) {
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return NULL;
+
+    if (lock_queue(queue, qid) == MF_ERROR) {
+        unpin_queue(qid);
+        return NULL;
     }
 
+    if (queue->count == 0 && !block) {
+        sem_post(&queue->mutex);
+        unpin_queue(qid);
+        *datalen = 0;
+        return NULL;
+    }
+    if (queue->count == 0)
+        queue->recv_blocks++;
+    while (queue->count == 0)
+        wait_on(queue, qid, &queue->recv_wait, &queue->recv_waiters);
+
+    TRACE_START(copy_start);
+    message_t* message = ring_peek(queue);
+    *datalen = message->datalength;
+    return message->data;
+}
 
-    message_t* data = queue->front->data;
+void *mf_recv_begin(int qid, int *datalen) {
+    return recv_begin(qid, datalen, 1);
+}
+
+// Remove the message returned by mf_recv_begin and unlock the queue.
+int mf_recv_commit(int qid) {
+    message_queue_t *queue = queue_at(qid);
+    if (queue == NULL)
+        return MF_ERROR;
+
+    message_t* message = ring_peek(queue);
+    TRACE(TR_DEQUEUE, qid, MSG_LEN(message), copy_start);
+    ring_pop(queue, message);
+
+    queue->recvs++;
+    check_watermarks(queue);
+    wake_all(&queue->send_wait, &queue->send_waiters);
+    wake_rings(queue);
+
+    sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return MF_SUCCESS;
+}
+
+// Leave the message returned by mf_recv_begin in the queue and unlock it.
+int mf_recv_cancel(int qid) {
+    message_queue_t *queue = queue_at(qid);
+    if (queue == NULL)
+        return MF_ERROR;
 
-    QueueNode* temp = queue->front;
+    sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return MF_SUCCESS;
+}
 
-    queue->front = queue->front->next;
-    free(temp);
+// Receive without waiting. Returns MF_EMPTY if the queue is empty.
+int recv_nowait(int qid, void *bufptr, int bufsize) {
+    int datalen = MF_ERROR;
+    void *data = recv_begin(qid, &datalen, 0);
+    if (data == NULL)
+        return datalen == 0 ? MF_EMPTY : MF_ERROR;
 
-    if (queue->front == NULL) {
-        queue->rear = NULL;
+    if (datalen > bufsize) {
+        fprintf(stderr, "Provided buffer is too small to hold the message.\n");
+        mf_recv_cancel(qid);
+        return MF_ERROR;
     }
 
-    return data;
+    memcpy(bufptr, data, datalen);
+    mf_recv_commit(qid);
+    return datalen;
 }
-void printQueue(Queue* queue) {
-    printf("Queue: ");
-    QueueNode* current = queue->front;
-    while (current != NULL) {
-        printf("%d ", current->data);
-        current = current->next;
+
+int mf_recv(int qid, void *bufptr, int bufsize) {
+    int datalen;
+    void *data = mf_recv_begin(qid, &datalen);
+    if (data == NULL)
+        return MF_ERROR;
+
+    if (datalen > bufsize) {
+        fprintf(stderr, "Provided buffer is too small to hold the message.\n");
+        mf_recv_cancel(qid);
+        return MF_ERROR;
     }
-    printf("\n");
+
+    memcpy(bufptr, data, datalen);
+    mf_recv_commit(qid);
+    return datalen;
+
 }
 
-void destroyQueue(Queue* queue) {
-    while (!isEmpty(queue)) {
-        dequeue(queue);
+// Receive the oldest message with (tag & mask) == value, skipping the
+// others, which stay in the queue. While there is none the caller sleeps
+// in a filter slot and is only woken by a send of a matching message.
+int mf_recv_match(int qid, unsigned int mask, unsigned int value, void *bufptr, int bufsize) {
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return MF_ERROR;
+
+    if (lock_queue(queue, qid) == MF_ERROR) {
+        unpin_queue(qid);
+        return MF_ERROR;
+    }
+
+    message_t *message = ring_find(queue, mask, value & mask);
+    if (message == NULL)
+        queue->recv_blocks++;
+    while (message == NULL) {
+        recv_filter_t *f = NULL;
+        for (int i = 0; i < MAX_FILTERS && f == NULL; i++) {
+            if (!queue->filters[i].used)
+                f = &queue->filters[i];
+        }
+        if (f != NULL) {
+            f->used = 1;
+            f->mask = mask;
+            f->value = value & mask;
+            wait_on(queue, qid, &f->wait, &f->waiters);
+            f->used = 0;
+        } else {
+            // all filter slots taken: wake up for every message instead
+            wait_on(queue, qid, &queue->recv_wait, &queue->recv_waiters);
+        }
+        message = ring_find(queue, mask, value & mask);
     }
-    free(queue);}
 
-message_t* peep(Queue* queue) {
-    if (queue == NULL || queue->front == NULL) {
-        printf("Queue is empty\n");
-        return NULL;
+    int datalen = message->datalength;
+    if (datalen > bufsize) {
+        fprintf(stderr, "Provided buffer is too small to hold the message.\n");
+        sem_post(&queue->mutex);
+        unpin_queue(qid);
+        return MF_ERROR;
     }
 
-    return queue->front->data;
+    TRACE_START(copy_start);
+    memcpy(bufptr, message->data, datalen);
+    TRACE(TR_DEQUEUE, qid, datalen, copy_start);
+    ring_pop(queue, message);
+
+    // even a pop from the middle that frees no space lowers count, which a
+    // sender may be waiting on
+    queue->recvs++;
+    check_watermarks(queue);
+    wake_all(&queue->send_wait, &queue->send_waiters);
+    wake_rings(queue);
+
+    sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return datalen;
 }
 
-message_t* traverseQueue(Queue* queue) {
-    QueueNode* temp = queue->front;
-    int count = 0;
 
-    while (temp->next != NULL) {
-        count++;
-        temp = temp->next;
+// Set the watermarks of a queue, in bytes of the queue in use. Producers
+// run out of credit when the queue fills to high and get it back once it
+// drains to low.
+int mf_set_watermarks(int qid, int low, int high) {
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return MF_ERROR;
+    if (low < 0 || low >= high || high > queue->capacity) {
+        fprintf(stderr, "Watermarks must satisfy 0 <= low < high <= %d\n", queue->capacity);
+        unpin_queue(qid);
+        return MF_ERROR;
     }
 
-    return temp->data;
+    int status = lock_sem(&queue->mutex);
+    if (status == MF_SUCCESS) {
+        queue->low_wm = low;
+        queue->high_wm = high;
+        check_watermarks(queue);
+        sem_post(&queue->mutex);
+    }
+    unpin_queue(qid);
+    return status;
 }
 
-int mf_send(int qid, void *bufptr, int datalen) {
+// Bytes that can still be sent before the queue reaches its high
+// watermark, 0 once it did until it drains to the low watermark.
+int mf_credit(int qid) {
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return MF_ERROR;
 
-    if (datalen % 4 != 0) {
+    if (lock_sem(&queue->mutex) == MF_ERROR) {
+        unpin_queue(qid);
+        return MF_ERROR;
+    }
+    int credit = 0;
+    if (!queue->above_high && queue->count < shm_header()->max_msgs_in_queue)
+        credit = queue->high_wm - queue->used;
+    sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return credit;
+}
 
-        int y = datalen;
+// Wait for the next watermark crossing after the one numbered *seq, for at
+// most timeout_ms (forever if negative). *seq is updated to the latest
+// crossing. Returns 1 if the queue is above its high watermark, 0 if it is
+// not, or MF_ERROR on timeout. Start with *seq = 0 to get the current state
+// at once.
+int mf_wait_watermark(int qid, unsigned int *seq, int timeout_ms) {
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return MF_ERROR;
 
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+    }
 
-        while(y % 4 != 0){
-            y++;;
+    if (lock_sem(&queue->mutex) == MF_ERROR) {
+        unpin_queue(qid);
+        return MF_ERROR;
+    }
+    while (queue->wm_seq == *seq && *seq != 0) {
+        if (timeout_ms < 0) {
+            wait_on(queue, qid, &queue->wm_wait, &queue->wm_waiters);
+        } else if (wait_on_until(queue, &queue->wm_wait, &queue->wm_waiters, &deadline) == MF_ERROR) {
+            sem_post(&queue->mutex);
+            unpin_queue(qid);
+            return MF_ERROR;
         }
+    }
+    *seq = queue->wm_seq;
+    int above = queue->above_high;
+    sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return above;
+}
+
+int mf_qstats(int qid, mf_qstats_t *stats) {
+    message_queue_t *queue = pin_queue(qid);
+    if (queue == NULL)
+        return MF_ERROR;
 
-        datalen = y;
+    if (lock_sem(&queue->mutex) == MF_ERROR) {
+        unpin_queue(qid);
+        return MF_ERROR;
     }
+    stats->capacity = queue->capacity;
+    stats->used = queue->used;
+    stats->count = queue->count;
+    stats->high_wm = queue->high_wm;
+    stats->low_wm = queue->low_wm;
+    stats->above_high = queue->above_high;
+    stats->sends = queue->sends;
+    stats->recvs = queue->recvs;
+    stats->send_blocks = queue->send_blocks;
+    stats->recv_blocks = queue->recv_blocks;
+    stats->high_crossings = queue->high_crossings;
+    stats->low_crossings = queue->low_crossings;
+    sem_post(&queue->mutex);
+    unpin_queue(qid);
+    return MF_SUCCESS;
+}
 
-    if (qid < 0 || qid >= 5 || addr[qid] == NULL) {
-        fprintf(stderr, "Invalid queue ID or queue does not exist\n");
-        return -1;
+
+sharded_t *sharded_at(int sid) {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return NULL;
+    }
+    if (sid < 0 || sid >= MAX_SHARDED || shm_header()->sharded[sid].used != 1) {
+        fprintf(stderr, "Invalid sharded queue ID or sharded queue does not exist\n");
+        return NULL;
     }
+    return &shm_header()->sharded[sid];
+}
 
-    datalen = datalen * 8;
-    message_queue_t *queue = addr[qid];
-    if (sem_wait(&queue->mutex) != 0) {
-        perror("Error acquiring semaphore");
-        return -1;
+int find_sharded(const char *mqname) {
+    shm_header_t *hdr = shm_header();
+    for (int i = 0; i < MAX_SHARDED; i++) {
+        if (hdr->sharded[i].used && strcmp(hdr->sharded[i].name, mqname) == 0)
+            return i;
     }
+    return -1;
+}
 
-    int available_space = (char*)queue->data + queue->capacity - (char*)queue->base_ptr;
-    if ((char*)queue->base_ptr <= (char*)queue->tail) {
-        available_space += (char*)queue->tail - (char*)queue->head;
-    } else {
-        available_space = (char*)queue->tail - (char*)queue->head;
+void shard_name(const char *mqname, int shard, char *name) {
+    snprintf(name, MAX_MQNAMESIZE, "%s#%d", mqname, shard);
+}
+
+// Wake every waiting member so that it works out its shards again. Called
+// with sh->lock held.
+void wake_members(sharded_t *sh) {
+    for (int p = 0; p < MAX_MEMBERS; p++) {
+        if (sh->waiting[p]) {
+            sh->waiting[p] = 0;
+            sem_post(&sh->member_wait[p]);
+        }
     }
+}
 
-    printf("Available space: %d, Data length: %d\n", available_space, datalen);
-    int total_space_needed = datalen + sizeof(message_t);
+// Take the member at position pos out of the group and rebalance. Called
+// with sh->lock held.
+void remove_member(sharded_t *sh, int pos) {
+    sh->generation++;
+    for (int p = pos; p < sh->nmembers - 1; p++)
+        sh->members[p] = sh->members[p + 1];
+    sh->nmembers--;
+    sh->generation++;
+    sh->rebalances++;
+    wake_members(sh);
+}
 
-    if(datalen + sizeof(message_t) > available_space){
-        do {
-            int head_index = (char*)queue->head - (char*)queue->data;
-            int tail_index = (char*)queue->tail - (char*)queue->data;
+// Position of member in the group and the group size, read without taking
+// the group lock: join and leave make generation odd while they change the
+// group, so a read that saw the same even generation before and after is
+// consistent. Returns -1 if member is not in the group.
+int group_view(sharded_t *sh, unsigned int member, int *nmembers, unsigned int *gen) {
+    for (;;) {
+        unsigned int g = sh->generation;
+        __sync_synchronize();
+        if (g & 1)
+            continue;
+        int pos = -1;
+        int n = sh->nmembers;
+        for (int p = 0; p < n && p < MAX_MEMBERS; p++) {
+            if (sh->members[p].id == member)
+                pos = p;
+        }
+        __sync_synchronize();
+        if (sh->generation == g) {
+            *nmembers = n;
+            *gen = g;
+            return pos;
+        }
+    }
+}
 
-            if (tail_index < head_index) {
-                available_space = head_index - tail_index - 1;
-            } else {
-                available_space = queue->capacity - (tail_index - head_index) - 1;
-            }
+// Create a logical queue of nshards physical queues of mqsize KB each.
+int mf_create_sharded(char *mqname, int mqsize, int nshards) {
+    char name[MAX_MQNAMESIZE];
+
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+    if (nshards < 1 || nshards > MAX_SHARDS) {
+        fprintf(stderr, "Number of shards must be between 1 and %d\n", MAX_SHARDS);
+        return MF_ERROR;
+    }
+    if (strlen(mqname) + 4 >= MAX_MQNAMESIZE) {
+        fprintf(stderr, "Queue name is too long\n");
+        return MF_ERROR;
+    }
 
-            if (total_space_needed > available_space) {
-                unallocated = datalen + sizeof(message_t);
-                sem_post(&queue->mutex);
-                usleep(100000);
-                sem_wait(&queue->mutex);
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+    int sid = -1;
+    for (int i = 0; i < MAX_SHARDED && sid == -1; i++) {
+        if (!hdr->sharded[i].used)
+            sid = i;
+    }
+    if (find_sharded(mqname) != -1 || sid == -1) {
+        fprintf(stderr, "Sharded queue %s exists or too many sharded queues\n", mqname);
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
+    sharded_t *sh = &hdr->sharded[sid];
+    memset(sh, 0, sizeof(sharded_t));
+    strncpy(sh->name, mqname, MAX_MQNAMESIZE - 1);
+    sh->used = 2; // reserved until the shards exist
+    unlock_header(hdr);
+
+    for (int i = 0; i < nshards; i++) {
+        shard_name(mqname, i, name);
+        if (mf_create(name, mqsize) == MF_ERROR) {
+            while (--i >= 0) {
+                shard_name(mqname, i, name);
+                mf_remove(name);
             }
-        } while (total_space_needed > available_space);}
+            lock_header(hdr);
+            sh->used = 0;
+            unlock_header(hdr);
+            return MF_ERROR;
+        }
+    }
 
-    message_t* message = (message_t*)queue->base_ptr;
-    message->datalength = datalen;
-    message->bufptr = (char*)message + sizeof(message_t);
+    lock_header(hdr);
+    for (int i = 0; i < nshards; i++) {
+        shard_name(mqname, i, name);
+        sh->shards[i] = find_queue(name);
+    }
+    sh->nshards = nshards;
+    sem_init(&sh->lock, 1, 1);
+    for (int p = 0; p < MAX_MEMBERS; p++)
+        sem_init(&sh->member_wait[p], 1, 0);
+    sh->used = 1;
+    unlock_header(hdr);
+    return MF_SUCCESS;
+}
 
-    memcpy(message->bufptr, bufptr, datalen);
+int mf_remove_sharded(char *mqname) {
+    char name[MAX_MQNAMESIZE];
 
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
 
-    queue->base_ptr = (char*)message->bufptr + datalen;
+    shm_header_t *hdr = shm_header();
+    if (lock_header(hdr) == MF_ERROR)
+        return MF_ERROR;
+    int sid = find_sharded(mqname);
+    if (sid == -1 || hdr->sharded[sid].used != 1) {
+        fprintf(stderr, "No sharded queue named %s\n", mqname);
+        unlock_header(hdr);
+        return MF_ERROR;
+    }
+    // shards are looked up by name: those that an earlier call that failed
+    // halfway removed are gone, and their ids may be in use again
+    sharded_t *sh = &hdr->sharded[sid];
+    int exists[MAX_SHARDS];
+    for (int i = 0; i < sh->nshards; i++) {
+        shard_name(mqname, i, name);
+        int qid = find_queue(name);
+        exists[i] = qid != -1;
+        message_queue_t *mq = exists[i] ? queue_at(qid) : NULL;
+        if (mq != NULL && mq->refcount != 0) {
+            printf("The reference count is not zero\n");
+            unlock_header(hdr);
+            return MF_ERROR;
+        }
+    }
+    sh->used = 2; // reserved until the shards are gone
+    unlock_header(hdr);
+
+    // the entry is kept if a shard stays, so that the removal can be tried
+    // again instead of leaving that shard behind
+    int status = MF_SUCCESS;
+    for (int i = 0; i < sh->nshards; i++) {
+        shard_name(mqname, i, name);
+        if (exists[i] && mf_remove(name) == MF_ERROR) {
+            status = MF_ERROR;
+            continue;
+        }
+        sh->shards[i] = -1; // sends to it fail instead of going elsewhere
+    }
+    lock_header(hdr);
+    sh->used = status == MF_SUCCESS ? 0 : 1;
+    unlock_header(hdr);
+    return status;
+}
 
+// Open all shards of a sharded queue. Returns its id.
+int mf_open_sharded(char *mqname) {
+    char name[MAX_MQNAMESIZE];
 
-    if (queue->tail == queue->head && queue->base_ptr != queue->head) {
-        queue->tail = queue->base_ptr;
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
     }
 
-    enqueue(addr[qid]->waitlist, message);
+    lock_header(shm_header());
+    int sid = find_sharded(mqname);
+    unlock_header(shm_header());
+    sharded_t *sh = sharded_at(sid);
+    if (sh == NULL)
+        return MF_ERROR;
 
-    printf("Message added at %p, new base_ptr is %p\n", message, queue->base_ptr);
+    for (int i = 0; i < sh->nshards; i++) {
+        shard_name(mqname, i, name);
+        if (mf_open(name) == MF_ERROR) {
+            while (--i >= 0)
+                mf_close(sh->shards[i]);
+            return MF_ERROR;
+        }
+    }
+    return sid;
+}
 
-    sem_post(&queue->mutex);
-    return 0;
+int mf_close_sharded(int sid) {
+    sharded_t *sh = sharded_at(sid);
+    if (sh == NULL)
+        return MF_ERROR;
 
+    int status = MF_SUCCESS;
+    for (int i = 0; i < sh->nshards; i++) {
+        if (mf_close(sh->shards[i]) == MF_ERROR)
+            status = MF_ERROR;
+    }
+    return status;
 }
 
+// Send to the shard of key, so that all messages of a key stay in order, or
+// to the next shard in turn if key is MF_ANY_KEY.
+int mf_send_sharded(int sid, unsigned int key, void *bufptr, int datalen) {
+    sharded_t *sh = sharded_at(sid);
+    if (sh == NULL)
+        return MF_ERROR;
+
+    int shard;
+    if (key == MF_ANY_KEY)
+        shard = __sync_fetch_and_add(&sh->rr, 1) % sh->nshards;
+    else
+        shard = ((key * 2654435761u) >> 8) % sh->nshards;
 
+    if (mf_send(sh->shards[shard], bufptr, datalen) == MF_ERROR)
+        return MF_ERROR;
 
-int mf_recv(int qid, void *bufptr, int bufsize) {
-    if (qid < 0 || qid >= 5 || addr[qid] == NULL) {
-        fprintf(stderr, "Invalid queue ID or queue does not exist.\n");
-        return -1;
+    // wake the owner of the shard if it is asleep; see mf_recv_group
+    __sync_synchronize();
+    int nmembers = sh->nmembers;
+    if (nmembers > 0 && sh->waiting[shard % nmembers]) {
+        lock_sem(&sh->lock);
+        int pos = sh->nmembers > 0 ? shard % sh->nmembers : 0;
+        if (sh->waiting[pos]) {
+            sh->waiting[pos] = 0;
+            sem_post(&sh->member_wait[pos]);
+        }
+        sem_post(&sh->lock);
     }
+    return MF_SUCCESS;
+}
 
+// Join the consumer group of a sharded queue. The shards are rebalanced
+// over the members. Returns the member id to receive with.
+int mf_join_group(int sid) {
+    sharded_t *sh = sharded_at(sid);
+    if (sh == NULL)
+        return MF_ERROR;
 
-    message_queue_t *queue = addr[qid];
-    if (sem_wait(&queue->mutex) != 0) {
-        perror("Error acquiring semaphore");
-        return -1;
+    lock_sem(&sh->lock);
+    if (sh->nmembers == MAX_MEMBERS) {
+        fprintf(stderr, "Consumer group of %s is full\n", sh->name);
+        sem_post(&sh->lock);
+        return MF_ERROR;
     }
+    sh->generation++;
+    unsigned int id = ++sh->member_seq;
+    sh->members[sh->nmembers].id = id;
+    sh->members[sh->nmembers].pid = getpid();
+    sh->nmembers++;
+    sh->generation++;
+    sh->rebalances++;
+    wake_members(sh);
+    sem_post(&sh->lock);
+    return id;
+}
 
-    while (isEmpty(queue->waitlist)) {
-        sem_post(&queue->mutex);
-        usleep(100000);
-        sem_wait(&queue->mutex);
+int mf_leave_group(int sid, int member) {
+    sharded_t *sh = sharded_at(sid);
+    if (sh == NULL)
+        return MF_ERROR;
+
+    lock_sem(&sh->lock);
+    for (int p = 0; p < sh->nmembers; p++) {
+        if (sh->members[p].id == (unsigned int)member) {
+            remove_member(sh, p);
+            sem_post(&sh->lock);
+            return MF_SUCCESS;
+        }
     }
+    sem_post(&sh->lock);
+    fprintf(stderr, "Not a member of the consumer group\n");
+    return MF_ERROR;
+}
 
-    if((char*)(traverseQueue(queue->waitlist)->tail) + unallocated > (char*)queue->tail){
-        queue->base_ptr = shm_addr;
+// Receive from the first non-empty shard owned by member.
+int scan_shards(sharded_t *sh, int pos, int nmembers, void *bufptr, int bufsize) {
+    static __thread int next_shard;
+    for (int k = 0; k < sh->nshards; k++) {
+        int shard = (next_shard + k) % sh->nshards;
+        if (shard % nmembers != pos)
+            continue;
+        int ret = recv_nowait(sh->shards[shard], bufptr, bufsize);
+        if (ret != MF_EMPTY) {
+            next_shard = shard + 1;
+            return ret;
+        }
     }
-    message_t* message = dequeue(queue->waitlist);
-    if (message->datalength > bufsize) {
-        fprintf(stderr, "Provided buffer is too small to hold the message.\n");
-        sem_post(&queue->mutex);
-        return -1;
+    return MF_EMPTY;
+}
+
+// Receive the next message from the shards that member owns, waiting if
+// they are all empty. Messages of one key are received in order by one
+// member, except right after a rebalance when the old and the new owner of
+// a shard may both be receiving from it.
+int mf_recv_group(int sid, int member, void *bufptr, int bufsize) {
+    sharded_t *sh = sharded_at(sid);
+    if (sh == NULL)
+        return MF_ERROR;
+
+    for (;;) {
+        int nmembers;
+        unsigned int gen;
+        int pos = group_view(sh, member, &nmembers, &gen);
+        if (pos < 0) {
+            fprintf(stderr, "Not a member of the consumer group\n");
+            return MF_ERROR;
+        }
+
+        int ret = scan_shards(sh, pos, nmembers, bufptr, bufsize);
+        if (ret != MF_EMPTY)
+            return ret;
+
+        // Say we are about to sleep, then look once more: a sender either
+        // put its message in before that look or sees the flag after it.
+        lock_sem(&sh->lock);
+        if (sh->generation != gen) {
+            sem_post(&sh->lock);
+            continue;
+        }
+        sh->waiting[pos] = 1;
+        sem_post(&sh->lock);
+        __sync_synchronize();
+
+        ret = scan_shards(sh, pos, nmembers, bufptr, bufsize);
+        if (ret != MF_EMPTY) {
+            lock_sem(&sh->lock);
+            if (sh->generation == gen)
+                sh->waiting[pos] = 0;
+            sem_post(&sh->lock);
+            return ret;
+        }
+
+        lock_sem(&sh->member_wait[pos]);
     }
+}
 
-    memcpy(bufptr, message->bufptr, message->datalength);
 
+// Submission and completion rings of mf_ring_create. They are private to
+// the process; the helper thread takes requests from sq, keeps the ones
+// that cannot be done yet in pending, and puts the results in cq.
+struct mf_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t submitted; // the helper sleeps here when it has nothing to do
+    pthread_cond_t completed; // mf_ring_complete callers sleep here
+    pthread_t helper;
+    int slot;                 // in the rings of the segment header
+    int stop;
+    int entries;
+    int inflight;             // submitted and not yet taken by mf_ring_complete
+    mf_sqe_t *sq;
+    int sq_head, sq_count;
+    mf_cqe_t *cq;
+    int cq_head, cq_count;
+    mf_sqe_t *pending;        // owned by the helper thread
+    int npending;
+    mf_cqe_t *done;           // completions of one pass of the helper
+};
+
+#define RING_IDLE_US 10000
+// longest the helper sleeps when none of its requests can go on, in case a
+// queue changed without waking it, e.g. when a dead client was reaped
+
+// Try the pending requests in order. A request is only tried if the ones
+// before it on the same queue went through, which keeps each queue in
+// submission order. Returns the number completed.
+int ring_progress(mf_ring_t *ring) {
+    char stuck[MAX_QUEUES][2];
+    memset(stuck, 0, sizeof(stuck));
+    int done = 0, kept = 0;
+
+    for (int i = 0; i < ring->npending; i++) {
+        mf_sqe_t *sqe = &ring->pending[i];
+        int dir = sqe->op == MF_OP_SEND;
+        int res;
+        if (sqe->qid < 0 || sqe->qid >= MAX_QUEUES || (sqe->op != MF_OP_SEND && sqe->op != MF_OP_RECV))
+            res = MF_ERROR;
+        else if (stuck[sqe->qid][dir])
+            res = dir ? MF_FULL : MF_EMPTY;
+        else if (dir)
+            res = send_nowait(sqe->qid, sqe->buf, sqe->len);
+        else
+            res = recv_nowait(sqe->qid, sqe->buf, sqe->len);
+
+        if (res == MF_FULL || res == MF_EMPTY) {
+            stuck[sqe->qid][dir] = 1;
+            ring->pending[kept++] = *sqe;
+            continue;
+        }
 
-    sem_post(&queue->mutex);
-    return message->datalength;
+        ring->done[done].user_data = sqe->user_data;
+        ring->done[done].res = res;
+        done++;
+    }
+    ring->npending = kept;
+
+    if (done > 0) {
+        pthread_mutex_lock(&ring->lock);
+        for (int i = 0; i < done; i++)
+            ring->cq[(ring->cq_head + ring->cq_count++) % ring->entries] = ring->done[i];
+        pthread_cond_broadcast(&ring->completed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return done;
+}
+
+// Sleep until one of the queues the pending requests wait for changes, a
+// request is submitted, or RING_IDLE_US passes. Returns at once if one of
+// them can go on by now. The helper drained its wake semaphore before it
+// last looked at sq, so no post since then is lost.
+void ring_idle(mf_ring_t *ring) {
+    sem_t *wake = &shm_header()->rings[ring->slot].wake;
+    char seen[MAX_QUEUES][2];
+    memset(seen, 0, sizeof(seen));
+
+    for (int i = 0; i < ring->npending; i++) {
+        mf_sqe_t *sqe = &ring->pending[i];
+        int dir = sqe->op == MF_OP_SEND;
+        // the first request of each queue and direction is the one that
+        // waits, the others wait behind it
+        if (seen[sqe->qid][dir])
+            continue;
+        seen[sqe->qid][dir] = 1;
+        message_queue_t *mq = pin_queue(sqe->qid);
+        if (mq == NULL)
+            return;
+        if (lock_queue(mq, sqe->qid) == MF_ERROR) {
+            unpin_queue(sqe->qid);
+            return;
+        }
+        int stuck;
+        if (dir)
+            stuck = !ring_fits(mq, sizeof(message_t) + ROUNDUP(sqe->len));
+        else
+            stuck = mq->count == 0;
+        if (stuck)
+            mq->ring_watch |= 1u << ring->slot;
+        sem_post(&mq->mutex);
+        unpin_queue(sqe->qid);
+        if (!stuck)
+            return;
+    }
 
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RING_IDLE_US * 1000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (sem_timedwait(wake, &deadline) == -1 && errno == EINTR)
+        ;
 }
 
-int mf_print() {
-    /*
-    printf("Shared Memory Overview:\n");
-    printf("Memory Name: %s\n", config.shmem_name);
-    printf("Memory Size: %d bytes\n", config.shmem_size);
-    printf("Number of Queues Configured: %d\n", unallocated);
+void *ring_helper(void *arg) {
+    mf_ring_t *ring = arg;
+    sem_t *wake = &shm_header()->rings[ring->slot].wake;
+
+    for (;;) {
+        while (sem_trywait(wake) == 0)
+            ;
+        pthread_mutex_lock(&ring->lock);
+        while (!ring->stop && ring->sq_count == 0 && ring->npending == 0)
+            pthread_cond_wait(&ring->submitted, &ring->lock);
+        if (ring->stop) {
+            pthread_mutex_unlock(&ring->lock);
+            return NULL;
+        }
+        while (ring->sq_count > 0) {
+            ring->pending[ring->npending++] = ring->sq[ring->sq_head];
+            ring->sq_head = (ring->sq_head + 1) % ring->entries;
+            ring->sq_count--;
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        int done = ring_progress(ring);
+        pthread_mutex_lock(&ring->lock);
+        int submitted = ring->sq_count;
+        pthread_mutex_unlock(&ring->lock);
+        // every pending request waits for another process
+        if (done == 0 && ring->npending > 0 && submitted == 0)
+            ring_idle(ring);
+    }
+}
 
-    int count = 0;
+// Create a ring for up to entries requests in flight and start its helper
+// thread. Must be called after mf_connect.
+mf_ring_t *mf_ring_create(int entries) {
+    if (entries < 1) {
+        fprintf(stderr, "A ring needs at least one entry\n");
+        return NULL;
+    }
 
-    for(int i = 0 ; i < 5 ; i++){
-    	if(addr[i] != NULL){
-    	    count++;
-    	}
+    mf_ring_t *ring = calloc(1, sizeof(mf_ring_t));
+    if (ring == NULL) {
+        perror("Failed to allocate memory for ring");
+        return NULL;
+    }
+    ring->entries = entries;
+    ring->sq = calloc(entries, sizeof(mf_sqe_t));
+    ring->cq = calloc(entries, sizeof(mf_cqe_t));
+    ring->pending = calloc(entries, sizeof(mf_sqe_t));
+    ring->done = calloc(entries, sizeof(mf_cqe_t));
+    if (ring->sq == NULL || ring->cq == NULL || ring->pending == NULL || ring->done == NULL) {
+        perror("Failed to allocate memory for ring");
+        free(ring->sq);
+        free(ring->cq);
+        free(ring->pending);
+        free(ring->done);
+        free(ring);
+        return NULL;
     }
 
-    for (int i = 0; i < count; i++) {
-        message_queue_t *queue = addr[i];
-        if (queue) {
+    // take a free slot, or the one of a process that died with its ring
+    shm_header_t *hdr = shm_header();
+    ring->slot = -1;
+    if (lock_header(hdr) == MF_SUCCESS) {
+        for (int r = 0; r < MAX_RINGS && ring->slot == -1; r++) {
+            int pid = hdr->rings[r].pid;
+            if (pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
+                hdr->rings[r].pid = getpid();
+                while (sem_trywait(&hdr->rings[r].wake) == 0)
+                    ;
+                ring->slot = r;
+            }
+        }
+        unlock_header(hdr);
+    }
+    if (ring->slot == -1) {
+        fprintf(stderr, "Too many rings\n");
+        free(ring->sq);
+        free(ring->cq);
+        free(ring->pending);
+        free(ring->done);
+        free(ring);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->submitted, NULL);
+    pthread_cond_init(&ring->completed, NULL);
+
+    if (pthread_create(&ring->helper, NULL, ring_helper, ring) != 0) {
+        perror("Failed to start ring helper thread");
+        hdr->rings[ring->slot].pid = 0;
+        free(ring->sq);
+        free(ring->cq);
+        free(ring->pending);
+        free(ring->done);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
 
-            printf("\nQueue %d: %s\n", i, queue->name);
-            printf("  Capacity: %d\n", queue->capacity);
-            printf("  Current Base Pointer: %p\n", queue->base_ptr);
-            printf("  Begin Address: %p\n", queue->head);
-            printf("  End Address: %p\n", queue->tail);
-            printf("  Reference Count: %d\n", queue->refcount);
-            printf("  Messages in Waitlist:\n");
+// Queue up to n requests. Returns how many were taken, which is less than
+// n when that many would be in flight.
+int mf_ring_submit(mf_ring_t *ring, mf_sqe_t *sqes, int n) {
+    pthread_mutex_lock(&ring->lock);
+    int taken = 0;
+    while (taken < n && ring->inflight < ring->entries) {
+        ring->sq[(ring->sq_head + ring->sq_count) % ring->entries] = sqes[taken];
+        ring->sq_count++;
+        ring->inflight++;
+        taken++;
+    }
+    if (taken > 0) {
+        pthread_cond_signal(&ring->submitted);
+        sem_post(&shm_header()->rings[ring->slot].wake);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return taken;
+}
+
+// Take up to max completions, waiting until there are at least min.
+// Returns the number taken.
+int mf_ring_complete(mf_ring_t *ring, mf_cqe_t *cqes, int max, int min) {
+    pthread_mutex_lock(&ring->lock);
+    if (min > ring->inflight)
+        min = ring->inflight;
+    while (ring->cq_count < min)
+        pthread_cond_wait(&ring->completed, &ring->lock);
+
+    int n = 0;
+    while (n < max && ring->cq_count > 0) {
+        cqes[n++] = ring->cq[ring->cq_head];
+        ring->cq_head = (ring->cq_head + 1) % ring->entries;
+        ring->cq_count--;
+        ring->inflight--;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return n;
+}
+
+// Stop the helper thread and free the ring. Requests still in flight are
+// dropped.
+int mf_ring_destroy(mf_ring_t *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_signal(&ring->submitted);
+    sem_post(&shm_header()->rings[ring->slot].wake);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->helper, NULL);
+    shm_header()->rings[ring->slot].pid = 0;
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->submitted);
+    pthread_cond_destroy(&ring->completed);
+    free(ring->sq);
+    free(ring->cq);
+    free(ring->pending);
+    free(ring->done);
+    free(ring);
+    return MF_SUCCESS;
+}
+
+
+long elapsed_us(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Hand a reply read from a reply queue to the caller waiting for it.
+// Called with call_lock held.
+void deliver_reply(char *frame, int len) {
+    rpc_header_t *rh = (rpc_header_t *)frame;
+    if (len < (int)sizeof(rpc_header_t) || rh->datalen > len - (int)sizeof(rpc_header_t)) {
+        fprintf(stderr, "Malformed reply message\n");
+        return;
+    }
 
-            if (isEmpty(queue->waitlist)) {
-                printf("  Message waitlist is empty.\n");
+    for (pending_call_t *pc = pending_calls; pc != NULL; pc = pc->next) {
+        if (pc->corr_id == rh->corr_id) {
+            if (rh->datalen > pc->repsize) {
+                fprintf(stderr, "Provided buffer is too small to hold the reply.\n");
+                pc->replen = MF_ERROR;
             } else {
-                QueueNode *current = queue->waitlist->front;
-                int msg_count = 0;
-                while (current != NULL) {
-                    printf("    Messages sent: \n");
-                    printf("    Message %d: The first messages is mapped to %p \n", msg_count++, (void*)current->data->head);
-                    printf("    Message %d: Length %d bytes\n", msg_count++, (void*)current->data->datalength);
-                    current = current->next;
-                }
+                memcpy(pc->repbuf, frame + sizeof(rpc_header_t), rh->datalen);
+                pc->replen = rh->datalen;
             }
-        } else {
-            printf("\nQueue %d is not initialized or has been removed.\n", i);
+            pc->done = 1;
+            return;
         }
     }
+    fprintf(stderr, "Dropping reply with unknown correlation id %u\n", rh->corr_id);
+}
+
+// Send a request to qid and block until the reply to this request arrives
+// on reply_qid. Any number of threads may have calls outstanding on the same
+// reply queue; whichever of them is reading the queue hands the replies out
+// to the others. The reply queue should not be shared with other processes.
+int mf_call(int qid, int reply_qid, void *reqbuf, int reqlen, void *repbuf, int repsize) {
+    char frame[MAX_DATALEN];
+    struct timespec start;
+
+    if (reqlen < 0 || reqlen > MAX_CALL_DATALEN) {
+        fprintf(stderr, "Request length must be at most %d bytes\n", MAX_CALL_DATALEN);
+        return MF_ERROR;
+    }
+    if (queue_at(reply_qid) == NULL)
+        return MF_ERROR;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pending_call_t pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.reply_qid = reply_qid;
+    pc.repbuf = repbuf;
+    pc.repsize = repsize;
+
+    pthread_mutex_lock(&call_lock);
+    pc.corr_id = ++call_seq;
+    pc.next = pending_calls;
+    pending_calls = &pc;
+    call_stats.inflight++;
+    if (call_stats.inflight > call_stats.max_inflight)
+        call_stats.max_inflight = call_stats.inflight;
+    pthread_mutex_unlock(&call_lock);
+
+    rpc_header_t *rh = (rpc_header_t *)frame;
+    rh->corr_id = pc.corr_id;
+    rh->reply_qid = reply_qid;
+    rh->datalen = reqlen;
+    memcpy(frame + sizeof(rpc_header_t), reqbuf, reqlen);
+
+    int status = mf_send(qid, frame, sizeof(rpc_header_t) + reqlen);
+
+    pthread_mutex_lock(&call_lock);
+    while (status == MF_SUCCESS && !pc.done) {
+        if (reply_reader[reply_qid]) {
+            pthread_cond_wait(&call_cond, &call_lock);
+            continue;
+        }
+
+        reply_reader[reply_qid] = 1;
+        pthread_mutex_unlock(&call_lock);
+        int n = mf_recv(reply_qid, frame, sizeof(frame));
+        pthread_mutex_lock(&call_lock);
+        reply_reader[reply_qid] = 0;
+
+        if (n == MF_ERROR)
+            status = MF_ERROR;
+        else
+            deliver_reply(frame, n);
+        pthread_cond_broadcast(&call_cond);
+    }
+
+    pending_call_t **pp = &pending_calls;
+    while (*pp != &pc)
+        pp = &(*pp)->next;
+    *pp = pc.next;
+
+    call_stats.inflight--;
+    if (status == MF_SUCCESS) {
+        long rtt = elapsed_us(&start);
+        if (call_stats.calls == 0 || rtt < call_stats.rtt_min_us)
+            call_stats.rtt_min_us = rtt;
+        if (rtt > call_stats.rtt_max_us)
+            call_stats.rtt_max_us = rtt;
+        call_stats.rtt_total_us += rtt;
+        call_stats.calls++;
+    } else {
+        call_stats.failed++;
+    }
+    pthread_mutex_unlock(&call_lock);
+
+    return status == MF_SUCCESS ? pc.replen : MF_ERROR;
+}
+
+// Receive a request sent with mf_call. The payload is copied to bufptr and
+// call is filled in so that the request can be answered with mf_reply. A
+// request that does not fit in bufsize stays in the queue, to be read
+// again with a larger buffer; call is filled in all the same, so that the
+// server can answer it with an error instead.
+int mf_recv_call(int qid, mf_call_t *call, void *bufptr, int bufsize) {
+    rpc_header_t rh;
+    int n;
+
+    char *frame = mf_recv_begin(qid, &n);
+    if (frame == NULL)
+        return MF_ERROR;
+
+    if (n >= (int)sizeof(rpc_header_t))
+        memcpy(&rh, frame, sizeof(rh));
+    if (n < (int)sizeof(rpc_header_t) || rh.datalen < 0 || rh.datalen > n - (int)sizeof(rpc_header_t)) {
+        fprintf(stderr, "Malformed request message\n");
+        mf_recv_commit(qid); // it can never be read
+        return MF_ERROR;
+    }
+
+    call->corr_id = rh.corr_id;
+    call->reply_qid = rh.reply_qid;
+    if (rh.datalen > bufsize) {
+        fprintf(stderr, "Provided buffer is too small to hold the request.\n");
+        mf_recv_cancel(qid);
+        return MF_ERROR;
+    }
+
+    memcpy(bufptr, frame + sizeof(rpc_header_t), rh.datalen);
+    mf_recv_commit(qid);
+    return rh.datalen;
+}
+
+int mf_reply(mf_call_t *call, void *bufptr, int datalen) {
+    char frame[MAX_DATALEN];
+
+    if (datalen < 0 || datalen > MAX_CALL_DATALEN) {
+        fprintf(stderr, "Reply length must be at most %d bytes\n", MAX_CALL_DATALEN);
+        return MF_ERROR;
+    }
+
+    rpc_header_t *rh = (rpc_header_t *)frame;
+    rh->corr_id = call->corr_id;
+    rh->reply_qid = call->reply_qid;
+    rh->datalen = datalen;
+    memcpy(frame + sizeof(rpc_header_t), bufptr, datalen);
+
+    return mf_send(call->reply_qid, frame, sizeof(rpc_header_t) + datalen);
+}
+
+int mf_call_stats(mf_call_stats_t *stats) {
+    pthread_mutex_lock(&call_lock);
+    *stats = call_stats;
+    pthread_mutex_unlock(&call_lock);
+    return MF_SUCCESS;
+}
+
+
+int mf_print() {
+    if (shm_addr == NULL) {
+        fprintf(stderr, "Not connected to the shared memory\n");
+        return MF_ERROR;
+    }
+
+    shm_header_t *hdr = shm_header();
+    mf_server_stats_t ss;
+    mf_server_stats(&ss);
+    printf("Shared Memory Overview:\n");
+    printf("Memory Name: %s\n", config.shmem_name);
+    printf("Memory Size: %d bytes\n", hdr->shmem_size);
+    printf("Connected Processes: %d\n", ss.clients);
+
+    for (int i = 0; i < MAX_QUEUES; i++) {
+        if (!hdr->queues[i].used)
+            continue;
+        message_queue_t *queue = pin_queue(i);
+        if (queue == NULL)
+            continue;
+        printf("\nQueue %d: %s\n", i, queue->name);
+        printf("  Offset: %d\n", hdr->queues[i].offset);
+        printf("  Capacity: %d\n", queue->capacity);
+        printf("  Used: %d\n", queue->used);
+        printf("  Messages: %d\n", queue->count);
+        printf("  Reference Count: %d\n", queue->refcount);
+        printf("  Sends: %ld (%ld blocked), Receives: %ld (%ld blocked)\n",
+               queue->sends, queue->send_blocks, queue->recvs, queue->recv_blocks);
+        printf("  Watermarks: low %d, high %d, %s, crossed high %ld times, low %ld times\n",
+               queue->low_wm, queue->high_wm, queue->above_high ? "above high" : "below high",
+               queue->high_crossings, queue->low_crossings);
+        if (hdr->queues[i].durable)
+            printf("  Durable: %lu messages flushed in %ld commits\n", queue->commit_seq, queue->commits);
+        unpin_queue(i);
+    }
+
+    for (int i = 0; i < MAX_SHARDED; i++) {
+        sharded_t *sh = &hdr->sharded[i];
+        if (sh->used != 1)
+            continue;
+        printf("\nSharded Queue %d: %s\n", i, sh->name);
+        printf("  Shards: %d, Consumers: %d, Rebalances: %ld\n", sh->nshards, sh->nmembers, sh->rebalances);
+    }
+
+    mf_call_stats_t st;
+    mf_call_stats(&st);
+    if (st.calls > 0 || st.inflight > 0) {
+        printf("\nCalls: %ld completed, %ld failed, %d in flight (max %d)\n",
+               st.calls, st.failed, st.inflight, st.max_inflight);
+        if (st.calls > 0)
+            printf("  Round trip: min %ld us, avg %ld us, max %ld us\n",
+                   st.rtt_min_us, st.rtt_total_us / st.calls, st.rtt_max_us);
+    }
     printf("\n");
     return MF_SUCCESS;
-    */
-    return 0;
-}
\ No newline at end of file
+}
@@ -28,9 +28,17 @@
 #define MAX_MQNAMESIZE 128
 // max message queue name size
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 int mf_init();
 int mf_destroy();
+// Warm restart: mf_detach leaves the segment and its queues in place when
+// mfserver exits, and mf_restart adopts them in the next mfserver.
+int mf_detach();
+int mf_restart();
 int mf_connect();
 int mf_disconnect();
 int mf_create(char *mqname, int mqsize);
@@ -41,6 +49,152 @@ int mf_send (int qid, void *bufptr, int datalen);
 int mf_recv (int qid, void *bufptr, int bufsize);
 int mf_print();
 
+// Create a queue kept in a file under DURABLE_DIR (see mf.config). mf_send
+// on it returns after the message is flushed; flushes are shared by the
+// senders of COMMIT_INTERVAL_US. Unreceived messages survive restarts.
+int mf_create_durable(char *mqname, int mqsize);
+
+// Selective receive. Messages carry a 32 bit tag, 0 for mf_send.
+// mf_recv_match receives the oldest message with (tag & mask) == value and
+// leaves the others in the queue.
+int mf_send_tagged(int qid, unsigned int tag, void *bufptr, int datalen);
+int mf_recv_match(int qid, unsigned int mask, unsigned int value, void *bufptr, int bufsize);
+
+// Asynchronous sends and receives. Requests put in the submission ring of
+// an mf_ring_t are carried out by a helper thread of the library, which
+// puts their results in the completion ring, so that one thread can keep
+// many requests in flight over several queues without blocking. Requests
+// on the same queue complete in the order they were submitted.
+#define MF_OP_SEND 1
+#define MF_OP_RECV 2
+
+typedef struct {
+    int op;                  // MF_OP_SEND or MF_OP_RECV
+    int qid;
+    void *buf;               // data to send or buffer to receive into,
+                             // untouched by the caller until completion
+    int len;                 // data length of a send, buffer size of a receive
+    unsigned long user_data; // given back in the completion
+} mf_sqe_t;
+
+typedef struct {
+    unsigned long user_data;
+    int res;                 // what mf_send or mf_recv would have returned
+} mf_cqe_t;
+
+typedef struct mf_ring mf_ring_t;
+
+mf_ring_t *mf_ring_create(int entries);
+int mf_ring_submit(mf_ring_t *ring, mf_sqe_t *sqes, int n);
+int mf_ring_complete(mf_ring_t *ring, mf_cqe_t *cqes, int max, int min);
+int mf_ring_destroy(mf_ring_t *ring);
+
+// Flow control. A queue is out of credit from when its used bytes reach
+// the high watermark until they drain to the low watermark (by default 3/4
+// and 1/4 of the queue). Producers can keep sending while mf_credit is
+// positive and wait for the next crossing with mf_wait_watermark once it is
+// not, instead of blocking in mf_send.
+typedef struct {
+    int capacity;
+    int used;
+    int count;
+    int high_wm;
+    int low_wm;
+    int above_high;
+    long sends;
+    long recvs;
+    long send_blocks;
+    long recv_blocks;
+    long high_crossings;
+    long low_crossings;
+} mf_qstats_t;
+
+int mf_set_watermarks(int qid, int low, int high);
+int mf_credit(int qid);
+int mf_wait_watermark(int qid, unsigned int *seq, int timeout_ms);
+int mf_qstats(int qid, mf_qstats_t *stats);
+
+// Housekeeping done by mfserver. mf_reap gives back the queue references of
+// processes that died without closing them, mf_compact moves idle queues
+// together so that the free memory is in one piece.
+typedef struct {
+    int clients;             // processes connected now
+    long clients_registered;
+    long clients_reaped;
+    long refs_released;      // references given back for reaped processes
+    long compactions;
+    long queues_moved;
+    long bytes_moved;
+    long members_reaped;     // dead consumers removed from consumer groups
+    long warm_restarts;      // times a new mfserver adopted the segment
+    long queues_dropped;     // queues found corrupt on a warm restart
+} mf_server_stats_t;
+
+int mf_reap();
+int mf_compact();
+int mf_server_stats(mf_server_stats_t *stats);
+
+// Sharded queues. A sharded queue is one name over nshards queues, each
+// with its own lock. Senders pick the shard by key, which keeps the
+// messages of a key in order, or in turn with MF_ANY_KEY. Consumers join
+// the group of the sharded queue and each receives from its own share of
+// the shards; the shares are recomputed whenever a consumer joins or leaves.
+#define MF_ANY_KEY 0xffffffffu
+
+int mf_create_sharded(char *mqname, int mqsize, int nshards);
+int mf_remove_sharded(char *mqname);
+int mf_open_sharded(char *mqname);
+int mf_close_sharded(int sid);
+int mf_send_sharded(int sid, unsigned int key, void *bufptr, int datalen);
+int mf_join_group(int sid);
+int mf_leave_group(int sid, int member);
+int mf_recv_group(int sid, int member, void *bufptr, int bufsize);
+
+// Zero copy send and receive. mf_send_begin reserves datalen bytes in the
+// queue and returns where to write them; mf_recv_begin returns the data of
+// the oldest message in place. The queue stays locked until the matching
+// commit (or mf_recv_cancel, which leaves the message in the queue), so keep
+// the work in between short. The data is aligned to 8 bytes.
+void *mf_send_begin(int qid, int datalen);
+int mf_send_commit(int qid);
+void *mf_recv_begin(int qid, int *datalen);
+int mf_recv_commit(int qid);
+int mf_recv_cancel(int qid);
+
+// Request/reply on top of message queues. mf_call sends a request tagged
+// with a correlation id and blocks until the matching reply arrives on
+// reply_qid. A server answers requests read with mf_recv_call by mf_reply.
+// A request too large for the buffer given to mf_recv_call is left in the
+// queue, with call filled in so that it can still be answered.
+// Requests and replies can carry at most MAX_DATALEN - 12 bytes.
+typedef struct {
+    unsigned int corr_id;
+    int reply_qid;
+} mf_call_t;
+
+typedef struct {
+    long calls;         // completed calls
+    long failed;
+    int inflight;       // calls waiting for their reply right now
+    int max_inflight;
+    long rtt_min_us;    // round trip latency of completed calls
+    long rtt_max_us;
+    long rtt_total_us;
+} mf_call_stats_t;
+
+int mf_call(int qid, int reply_qid, void *reqbuf, int reqlen, void *repbuf, int repsize);
+int mf_recv_call(int qid, mf_call_t *call, void *bufptr, int bufsize);
+int mf_reply(mf_call_t *call, void *bufptr, int datalen);
+int mf_call_stats(mf_call_stats_t *stats);
+
+// Write the trace ring of this process to TRACE_DIR in mf.config. This is
+// done automatically on disconnect and exit; merge the files with mftrace.
+int mf_trace_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
 
 #endif
 
@@ -0,0 +1,130 @@
+#ifndef _MF_HPP_
+#define _MF_HPP_
+
+// Header only C++ interface of the MF library.
+//
+//     mf::connection conn;                 // mf_connect / mf_disconnect
+//     mf::channel<Sample> ch("mq1");       // mf_open / mf_close
+//     ch.send(1, 2.5);                     // constructs Sample{1, 2.5} in the queue
+//     Sample s = ch.recv();
+//
+// The message layout is checked at compile time, and send and the callback
+// form of recv work on the message in the shared memory without an extra
+// copy. Errors are reported by throwing mf::error.
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "mf.h"
+
+namespace mf {
+
+class error : public std::runtime_error {
+public:
+    explicit error(const std::string &what) : std::runtime_error(what) {}
+};
+
+class connection {
+public:
+    connection() {
+        if (mf_connect() != 0)
+            throw error("mf_connect failed");
+    }
+    ~connection() { mf_disconnect(); }
+
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+};
+
+// An open message queue.
+class queue {
+public:
+    explicit queue(const char *name) : qid_(mf_open(const_cast<char *>(name))) {
+        if (qid_ < 0)
+            throw error(std::string("mf_open failed: ") + name);
+    }
+    queue(queue &&other) noexcept : qid_(other.qid_) { other.qid_ = -1; }
+    queue &operator=(queue &&other) noexcept {
+        std::swap(qid_, other.qid_);
+        return *this;
+    }
+    ~queue() {
+        if (qid_ >= 0)
+            mf_close(qid_);
+    }
+
+    queue(const queue &) = delete;
+    queue &operator=(const queue &) = delete;
+
+    int id() const { return qid_; }
+
+private:
+    int qid_;
+};
+
+// A queue carrying messages of type T only.
+template <typename T>
+class channel {
+    static_assert(std::is_trivially_copyable<T>::value, "channel messages must be trivially copyable");
+    static_assert(sizeof(T) >= MIN_DATALEN && sizeof(T) <= MAX_DATALEN, "message does not fit in MAX_DATALEN");
+    static_assert(alignof(T) <= 8, "message data in the queue is only 8 byte aligned");
+
+public:
+    explicit channel(const char *name) : q_(name) {}
+
+    // Construct T{args...} directly in the queue.
+    template <typename... Args>
+    void send(Args &&...args) {
+        static_assert(noexcept(T{std::declval<Args>()...}),
+                      "T must be constructed without throwing while the queue is locked");
+        void *p = mf_send_begin(q_.id(), sizeof(T));
+        if (p == nullptr)
+            throw error("mf_send failed");
+        new (p) T{std::forward<Args>(args)...};
+        // on a durable queue this is where the flush can fail
+        if (mf_send_commit(q_.id()) != 0)
+            throw error("mf_send_commit failed");
+    }
+
+    // Pass the oldest message to f while it is still in the queue, then
+    // remove it. The queue is locked while f runs.
+    template <typename F>
+    void recv(F &&f) {
+        int datalen;
+        void *p = mf_recv_begin(q_.id(), &datalen);
+        if (p == nullptr)
+            throw error("mf_recv failed");
+        if (datalen != sizeof(T)) {
+            mf_recv_cancel(q_.id());
+            throw error("message size does not match the channel type");
+        }
+        try {
+            f(*static_cast<const T *>(p));
+        } catch (...) {
+            mf_recv_cancel(q_.id());
+            throw;
+        }
+        mf_recv_commit(q_.id());
+    }
+
+    // Copy the oldest message out of the queue. T need not be default
+    // constructible: being trivially copyable, it is copied into storage of
+    // its size and alignment and read from there.
+    T recv() {
+        alignas(T) unsigned char storage[sizeof(T)];
+        recv([&storage](const T &msg) { std::memcpy(storage, &msg, sizeof(T)); });
+        return *reinterpret_cast<T *>(storage);
+    }
+
+    int id() const { return q_.id(); }
+
+private:
+    queue q_;
+};
+
+} // namespace mf
+
+#endif
@@ -7,6 +7,11 @@
 #include "mf.h"
 #include <signal.h>
 
+#define HOUSEKEEPING_INTERVAL 1 // seconds between reaping and compacting
+
+volatile sig_atomic_t print_stats = 0;
+volatile sig_atomic_t restart_requested = 0;
+
 // Signal handler function for termination requests
 void signal_handler(int signum) {
     if (signum == SIGINT || signum == SIGTERM) {
@@ -14,25 +19,63 @@ void signal_handler(int signum) {
         mf_destroy(); // Call mf_destroy() for cleanup
         exit(0);
     }
+    if (signum == SIGUSR2)
+        restart_requested = 1; // detached from the main loop, between passes
+    if (signum == SIGUSR1)
+        print_stats = 1;
 }
 
+void show_stats() {
+    mf_server_stats_t st;
+    if (mf_server_stats(&st) != 0)
+        return;
+    printf("mfserver stats: %d clients connected, %ld registered, %ld reaped, "
+           "%ld references released, %ld compactions, %ld queues moved (%ld bytes), "
+           "%ld dead consumers removed, %ld warm restarts, %ld queues dropped\n",
+           st.clients, st.clients_registered, st.clients_reaped, st.refs_released,
+           st.compactions, st.queues_moved, st.bytes_moved, st.members_reaped,
+           st.warm_restarts, st.queues_dropped);
+    fflush(stdout);
+}
+
+// usage: ./mfserver [-w]
+//   -w  warm restart: adopt the queues left by the previous mfserver (stopped
+//       with SIGUSR2, or crashed) so that clients keep running through it
 int main(int argc, char *argv[]) {
+    int warm = argc > 1 && strcmp(argv[1], "-w") == 0;
     printf("mfserver pid=%d\n", (int)getpid());
 
     // Register the signal handler function
     signal(SIGINT, signal_handler); // Handle Ctrl-C
     signal(SIGTERM, signal_handler); // Handle termination signal
+    signal(SIGUSR1, signal_handler); // Print the stats
+    signal(SIGUSR2, signal_handler); // Exit for a warm restart
 
-    mf_init(); // Initialize MF library
-
-    // Perform any additional initialization if needed
+    if (warm && mf_restart() == 0) {
+        printf("Warm restart, queues adopted\n");
+    } else if (mf_init() != 0) { // Initialize MF library
+        fprintf(stderr, "mf_init failed\n");
+        exit(1);
+    }
 
+    // Give back the queue references of clients that crashed, and move idle
+    // queues together so that large mf_create calls find room.
     while (1) {
-        sleep(1000); // Sleep to keep the server running
+        sleep(HOUSEKEEPING_INTERVAL);
+        if (restart_requested) {
+            printf("Restart signal received. Leaving the queues for the next server...\n");
+            mf_detach(); // keep the segment for mfserver -w
+            exit(0);
+        }
+        int reaped = mf_reap();
+        int moved = mf_compact();
+        if (reaped > 0 || moved > 0)
+            fflush(stdout);
+        if (print_stats) {
+            print_stats = 0;
+            show_stats();
+        }
     }
 
     return 0; // This line will not be reached
 }
-
-
-
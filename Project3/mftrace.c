@@ -0,0 +1,123 @@
+// Merge the trace files written by MF processes into one Chrome trace
+// (load it in chrome://tracing or https://ui.perfetto.dev).
+//
+// usage: ./mftrace mf_trace_*.bin > trace.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "mftrace.h"
+
+typedef struct {
+    int pid;
+    long count;
+    trace_event_t *events;
+} trace_t;
+
+int read_trace(const char *path, trace_t *trace) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    trace_file_t th;
+    if (fread(&th, sizeof(th), 1, file) != 1 || th.magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not an MF trace file\n", path);
+        fclose(file);
+        return -1;
+    }
+    if (th.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: trace format %d, this mftrace reads %d\n", path, th.version, TRACE_VERSION);
+        fclose(file);
+        return -1;
+    }
+
+    // the count comes from the file, so it is only trusted as far as the
+    // file is long
+    struct stat st;
+    if (fstat(fileno(file), &st) == -1 || th.count < 0 ||
+        th.count > (long)((st.st_size - sizeof(th)) / sizeof(trace_event_t))) {
+        fprintf(stderr, "%s: truncated or damaged trace file\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    trace->pid = th.pid;
+    trace->events = malloc(th.count * sizeof(trace_event_t));
+    if (trace->events == NULL) {
+        perror("Failed to allocate memory for events");
+        fclose(file);
+        return -1;
+    }
+    trace->count = fread(trace->events, sizeof(trace_event_t), th.count, file);
+    if (th.dropped > 0)
+        fprintf(stderr, "%s: %ld older events were overwritten\n", path, th.dropped);
+
+    fclose(file);
+    return 0;
+}
+
+const char *event_name(int type) {
+    switch (type) {
+    case TR_LOCK: return "lock";
+    case TR_BLOCK: return "block";
+    case TR_WAKE: return "blocked";
+    case TR_ENQUEUE: return "enqueue";
+    case TR_DEQUEUE: return "dequeue";
+    }
+    return "unknown";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s tracefile...\n", argv[0]);
+        exit(1);
+    }
+
+    trace_t *traces = calloc(argc - 1, sizeof(trace_t));
+    int ntraces = 0;
+    for (int i = 1; i < argc; i++) {
+        if (read_trace(argv[i], &traces[ntraces]) == 0)
+            ntraces++;
+    }
+
+    // timestamps are shown relative to the first event of all processes
+    unsigned long base = 0;
+    for (int i = 0; i < ntraces; i++) {
+        for (long j = 0; j < traces[i].count; j++) {
+            trace_event_t *ev = &traces[i].events[j];
+            if (base == 0 || ev->ts - ev->dur < base)
+                base = ev->ts - ev->dur;
+        }
+    }
+
+    printf("{\"traceEvents\":[\n");
+    int first = 1;
+    for (int i = 0; i < ntraces; i++) {
+        printf("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"pid %d\"}}",
+               first ? "" : ",\n", traces[i].pid, traces[i].pid);
+        first = 0;
+
+        for (long j = 0; j < traces[i].count; j++) {
+            trace_event_t *ev = &traces[i].events[j];
+            double start = (ev->ts - ev->dur - base) / 1000.0;
+            if (ev->type == TR_BLOCK) {
+                printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                       "\"args\":{\"qid\":%d}}",
+                       event_name(ev->type), start, traces[i].pid, ev->tid, ev->qid);
+            } else {
+                printf(",\n{\"name\":\"%s\",\"cat\":\"q%d\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"pid\":%d,\"tid\":%d,\"args\":{\"qid\":%d,\"size\":%d}}",
+                       event_name(ev->type), ev->qid, start, ev->dur / 1000.0,
+                       traces[i].pid, ev->tid, ev->qid, ev->size);
+            }
+        }
+        free(traces[i].events);
+    }
+    printf("\n]}\n");
+
+    free(traces);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef _MFTRACE_H_
+#define _MFTRACE_H_
+
+// Format of the trace files written by the MF library when TRACE_EVENTS is
+// set in mf.config, and read by mftrace.
+
+#define TRACE_MAGIC 0x4d465452 // "MFTR"
+#define TRACE_VERSION 2
+// 2: dur is 64 bits wide, as a block can last longer than 4.29 s
+#define TRACE_FILE_FMT "%s/mf_trace_%d.bin"
+// trace directory, pid
+
+enum {
+    TR_LOCK = 1, // queue lock acquired, dur is the time spent waiting for it
+    TR_BLOCK,    // about to sleep because the queue is full or empty
+    TR_WAKE,     // woke up again, dur is the time spent asleep
+    TR_ENQUEUE,  // message copied into the queue, dur is the memcpy time
+    TR_DEQUEUE   // message copied out of the queue, dur is the memcpy time
+};
+
+typedef struct {
+    unsigned long ts;  // ns, CLOCK_MONOTONIC, end of the event
+    unsigned long dur; // ns
+    int tid;
+    short type;
+    short qid;
+    int size;
+} trace_event_t;
+
+// A trace file is this header followed by count events, oldest first.
+typedef struct {
+    int magic;
+    int version;  // TRACE_VERSION
+    int pid;
+    long count;   // events in the file
+    long dropped; // older events overwritten in the ring
+} trace_file_t;
+
+#endif